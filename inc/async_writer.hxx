@@ -0,0 +1,53 @@
+#ifndef __ASYNC_WRITER_HXX__
+#define __ASYNC_WRITER_HXX__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+/*
+ * Encodes and writes result images on a background thread. At most
+ * maxPending images wait in the queue; Write() blocks beyond that so the
+ * memory held by queued mosaics stays bounded. params are passed to
+ * cv::imwrite (JPEG quality, PNG compression, ...).
+ */
+class AsyncWriter
+{
+public:
+    explicit AsyncWriter(size_t maxPending = 2,
+            const std::vector<int>& params = std::vector<int>());
+    ~AsyncWriter();
+
+    AsyncWriter(AsyncWriter&&) = delete;
+    AsyncWriter(const AsyncWriter&) = delete;
+
+public:
+    void Write(const std::string& path, const cv::Mat& image);
+    void Flush();
+
+private:
+    struct WriteJob
+    {
+        std::string path;
+        cv::Mat image;
+    };
+
+    void writerLoop();
+
+private:
+    bool m_bStopping;
+    size_t m_maxPending;
+    size_t m_inProgress;
+    std::vector<int> m_params;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<WriteJob> m_jobs;
+    std::thread m_thread;
+};
+
+#endif // __ASYNC_WRITER_HXX__
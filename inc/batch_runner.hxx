@@ -0,0 +1,77 @@
+#ifndef __BATCH_RUNNER_HXX__
+#define __BATCH_RUNNER_HXX__
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Stitcher;
+class ThreadPool;
+
+/*
+ * One input directory to stitch into <output>/result.<extension>.
+ */
+struct BatchJob
+{
+    std::string input;
+    std::string output;
+};
+
+typedef std::vector<BatchJob> BatchJobs;
+
+/*
+ * Runs many stitching jobs in one process. Up to maxJobs jobs run at once,
+ * each on its own runner thread. A job decodes and detects its images a
+ * few ahead on the shared thread pool, and registers them into its mosaic
+ * one by one on the runner thread, releasing each frame once it is folded
+ * in. The memory cap is only checked at admission: a new job is started
+ * while the resident set is under it (or when nothing else runs), a running
+ * job is not held to it. Every finished job is logged and, if a status
+ * file is set, appended to it as one JSON line.
+ */
+class BatchRunner
+{
+public:
+    BatchRunner(const Stitcher& stitcher, ThreadPool& pool, size_t maxJobs,
+            size_t memoryCapMb, const std::string& statusPath);
+    ~BatchRunner();
+
+    BatchRunner(BatchRunner&&) = delete;
+    BatchRunner(const BatchRunner&) = delete;
+
+public:
+    static bool LoadManifest(const std::string& path, BatchJobs& jobs);
+    void SetEncoder(const std::string& extension,
+            const std::vector<int>& params);
+    void Add(const BatchJob& job);
+    size_t Finish();
+
+private:
+    void runnerLoop();
+    bool admissible() const;
+    bool runJob(const BatchJob& job, size_t& images, std::string& error)
+        const;
+    void report(const BatchJob& job, bool done, size_t images,
+            double seconds, const std::string& error);
+
+private:
+    const Stitcher& m_stitcher;
+    ThreadPool& m_pool;
+    size_t m_memoryCapKb;
+    std::string m_extension;
+    std::vector<int> m_params;
+    bool m_bClosed;
+    size_t m_running;
+    size_t m_failed;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<BatchJob> m_jobs;
+    std::vector<std::thread> m_runners;
+    std::ofstream m_status;
+};
+
+#endif // __BATCH_RUNNER_HXX__
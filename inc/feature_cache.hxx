@@ -0,0 +1,39 @@
+#ifndef __FEATURE_CACHE_HXX__
+#define __FEATURE_CACHE_HXX__
+
+#include <cstdint>
+#include <string>
+
+#include "image_features.hxx"
+
+/*
+ * On-disk store of detected features. Every entry is a sidecar file named
+ * after a hash of the source image content and of the detector parameters,
+ * so a changed file or a different --keypoints value never hits a stale
+ * entry. Descriptors are stored raw and row-major right after the packed
+ * keypoints, which lets Load() map the file and hand the descriptor block
+ * out as a cv::Mat without parsing or copying it.
+ */
+class FeatureCache
+{
+public:
+    explicit FeatureCache(const std::string& dir);
+    ~FeatureCache() = default;
+
+public:
+    std::string MakeKey(const std::string& imagePath,
+            const std::string& params) const;
+    bool Load(const std::string& key, ImageFeatures& features) const;
+    bool Store(const std::string& key, const ImageFeatures& features) const;
+
+private:
+    std::string entryPath(const std::string& key) const;
+    static uint64_t hashBytes(const void* data, size_t size,
+            uint64_t seed = 14695981039346656037ULL);
+    static bool hashFile(const std::string& path, uint64_t& hash);
+
+private:
+    std::string m_dir;
+};
+
+#endif // __FEATURE_CACHE_HXX__
@@ -0,0 +1,38 @@
+#ifndef __IMAGE_FEATURES_HXX__
+#define __IMAGE_FEATURES_HXX__
+
+#include <memory>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace cv {
+    class DescriptorMatcher;
+}; // cv
+
+typedef std::vector<cv::KeyPoint> KeyPoints;
+
+/*
+ * Keypoints and descriptors detected once on an input image and kept
+ * around so the image can be matched against its neighbours without
+ * running the detector again. When the descriptors point into memory they
+ * do not own (e.g. a mapped feature cache entry), storage keeps it alive.
+ * The search index over the descriptors is built on first use as the train
+ * side of a match and reused for every later neighbour. Keypoints are always
+ * in full-resolution coordinates; scale is the working resolution they were
+ * detected at, which bounds their precision. partial is set when only some
+ * regions of the image (the predicted overlaps) were searched.
+ */
+struct ImageFeatures
+{
+    KeyPoints keypoints;
+    cv::Mat descriptors;
+    std::shared_ptr<const void> storage;
+    mutable cv::Ptr<cv::DescriptorMatcher> index;
+    float scale = 1.0f;
+    bool partial = false;
+
+    bool empty() const { return keypoints.empty() || descriptors.empty(); }
+};
+
+#endif // __IMAGE_FEATURES_HXX__
@@ -1,8 +1,12 @@
 #ifndef __IMAGE_PROCESSING_HXX__
 #define __IMAGE_PROCESSING_HXX__
 
+#include <string>
 #include <vector>
 
+#include "image_features.hxx"
+#include "warp_kernel.hxx"
+
 namespace cv {
     class Mat;
     class DMatch;
@@ -10,34 +14,117 @@ namespace cv {
     template <typename T> class Ptr;
 }; // cv
 
+enum class DetectorType
+{
+    SIFT,
+    ORB,
+    AKAZE
+};
+
+enum class MatcherType
+{
+    BRUTE_FORCE,
+    KDTREE,
+    LSH
+};
+
+enum class EstimatorType
+{
+    RANSAC,
+    PROSAC,
+    USAC,
+    MAGSAC
+};
+
+/*
+ * Robust homography estimation settings. PROSAC samples the best matches
+ * (by descriptor distance) first, so easy pairs terminate after a few
+ * iterations; USAC is uniform sampling with MSAC scoring and MAGSAC
+ * marginalises over the noise scale.
+ */
+struct EstimatorParams
+{
+    EstimatorType type = EstimatorType::RANSAC;
+    double confidence = 0.995;
+    int maxIters = 2000;
+    bool localOptimization = false;
+};
+
+struct EstimationStats
+{
+    int matches = 0;
+    int inliers = 0;
+    int iterationsBound = 0; // from the inlier ratio, not a measured count
+};
+
 typedef std::vector<cv::DMatch> DMatchVec;
 typedef std::vector<cv::Point2f> Point2fVec;
-typedef std::vector<cv::KeyPoint> KeyPoints;
+typedef std::vector<cv::Rect> RectVec;
 
 class ImageProcessing
 {
 public:
-    ImageProcessing();
+    ImageProcessing(DetectorType detectorType = DetectorType::SIFT,
+            MatcherType matcherType = MatcherType::BRUTE_FORCE,
+            int featherWidth = 0,
+            const EstimatorParams& estimator = EstimatorParams(),
+            int gridSize = 0);
 
 public:
     void MakeGray(const cv::Mat& img, cv::Mat& res) const;
+    std::string FeatureParams(int keypointsCount) const;
+    void DetectFeatures(const cv::Mat& img, ImageFeatures& features,
+            int keypointsCount = 10000) const;
+    void DetectFeatures(const cv::Mat& img, ImageFeatures& features,
+            int keypointsCount, const RectVec& rois) const;
+    void MatchFeatures(const ImageFeatures& img1Features,
+            const ImageFeatures& img2Features, DMatchVec& matches,
+            float ratio = 0.75) const;
+    void BuildIndex(const ImageFeatures& features) const;
     void FindMatches(const cv::Mat& img1, const cv::Mat& img2,
             DMatchVec& matches, KeyPoints& img1Kpts, KeyPoints& img2Kpts,
             float ratio = 0.75, int keypointsCount = 10000) const;
     void TransformHomography(const KeyPoints& kp1, const KeyPoints& kp2,
             const DMatchVec& matches, cv::Mat& homography,
-            float ransac = 1.5) const;
+            float ransac = 1.5, EstimationStats* stats = nullptr) const;
+    bool RefineHomography(const cv::Mat& img1, const cv::Mat& img2,
+            cv::Mat& homography, float ratio, float ransac, float tolerance,
+            int keypointsCount) const;
+    double OverlapConsistency(const cv::Mat& img1, const cv::Mat& img2,
+            const cv::Mat& homography) const;
     void TransformCorners(const cv::Mat& img1, const cv::Mat& img2,
             const cv::Mat& homography, Point2fVec& allCorners) const;
+    void TransformCorners(const cv::Size& size1, const cv::Size& size2,
+            const cv::Mat& homography, Point2fVec& allCorners) const;
+    void CanvasGeometry(const Point2fVec& allCorners, cv::Point& offset,
+            cv::Size& size) const;
     void WarpImages(const cv::Mat& img1, const cv::Mat& img2,
             const cv::Mat& homography, const Point2fVec& allCorners,
             cv::Mat& res) const;
+    void WarpImages(const cv::Mat& img1, const cv::Mat& img2,
+            const cv::Mat& homography, const Point2fVec& allCorners,
+            cv::Mat& res, cv::Point& offset) const;
+    void MergeFeatures(const cv::Mat& img1, const ImageFeatures& img1Features,
+            const ImageFeatures& img2Features, const cv::Mat& homography,
+            const cv::Point& offset, ImageFeatures& res) const;
 
 private:
     void computeCorners(const cv::Mat& img, Point2fVec& corners) const;
+    void computeCorners(const cv::Size& size, Point2fVec& corners) const;
+    cv::Ptr<cv::Feature2D> createDetector(int keypointsCount) const;
+    void detectBucketed(const cv::Mat& img, int gridSize,
+            ImageFeatures& features, int keypointsCount) const;
+    cv::Ptr<cv::DescriptorMatcher> createMatcher(int descriptorsType) const;
+    cv::Mat findHomography(const Point2fVec& src, const Point2fVec& dst,
+            float ransac, cv::Mat& inliers) const;
 
 private:
     cv::Ptr<cv::CLAHE> m_clahe;
+    DetectorType m_detectorType;
+    MatcherType m_matcherType;
+    EstimatorParams m_estimator;
+    int m_gridSize;
+    WarpKernel m_warpKernel;
 };
 
 #endif // __IMAGE_PROCESSING_HXX__
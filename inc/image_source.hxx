@@ -0,0 +1,57 @@
+#ifndef __IMAGE_SOURCE_HXX__
+#define __IMAGE_SOURCE_HXX__
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <opencv2/core.hpp>
+
+/*
+ * Decodes input images. Files are mapped and decoded straight from the
+ * mapping, and decoded images are kept in an LRU cache bounded to cacheMb,
+ * so an image used twice in a run is decoded once. Read with megapix > 0 is
+ * for the registration path: a JPEG is decoded at 1/2, 1/4 or 1/8 scale by
+ * the codec (DCT scaling) when the result still has megapix, instead of
+ * decoded whole and resized; size then receives the full size of the input,
+ * oriented as decoded (EXIF rotation applied, as cv::imread does). Returned
+ * images share their pixels with the cache and must not be written to.
+ * Read is thread safe.
+ */
+class ImageSource
+{
+public:
+    explicit ImageSource(size_t cacheMb = 0);
+    ~ImageSource() = default;
+
+    ImageSource(ImageSource&&) = delete;
+    ImageSource(const ImageSource&) = delete;
+
+public:
+    cv::Mat Read(const std::string& path, double megapix = 0,
+            cv::Size* size = nullptr);
+    size_t CachedBytes() const;
+
+private:
+    struct Entry
+    {
+        std::string key;
+        cv::Mat image;
+    };
+
+    bool lookup(const std::string& key, cv::Mat& image);
+    void insert(const std::string& key, const cv::Mat& image);
+    static int reduction(const cv::Size& size, double megapix);
+    static bool headerSize(const unsigned char* data, size_t size,
+            cv::Size& res);
+
+private:
+    size_t m_capBytes;
+    size_t m_bytes;
+    std::list<Entry> m_entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+    mutable std::mutex m_mutex;
+};
+
+#endif // __IMAGE_SOURCE_HXX__
@@ -1,14 +1,67 @@
 #ifndef __IMAGE_STITCHING_HXX__
 #define __IMAGE_STITCHING_HXX__
 
+#include <chrono>
+#include <mutex>
 #include <string>
+#include <vector>
+
+#include "image_features.hxx"
+#include "image_processing.hxx"
+#include "image_view.hxx"
+#include "mosaic_canvas.hxx"
+#include "rig_calibration.hxx"
 
 namespace cv {
     class Mat;
 }; // cv
 
-class ImageProcessing;
+class FeatureCache;
+class ImageSource;
+class AsyncWriter;
+
+/*
+ * Input image decoded and with its features detected, ready to be stitched.
+ * Frames are prepared ahead of time (possibly on other threads) and then
+ * handed to the Stitcher in sequence order. Without compositing the image
+ * is only registered, so it may be decoded reduced; size and features stay
+ * in input pixels (an empty size is the image size).
+ */
+struct StitchFrame
+{
+    std::string path;
+    cv::Mat image;
+    cv::Size size;
+    float scale = 1.0f; // image pixels per input pixel
+    ImageFeatures features;
+};
 
+/*
+ * Registration settings of one rung of the budget mode quality ladder and
+ * the outcome of a pair registered under it.
+ */
+struct QualityLevel
+{
+    float megapix; // 0 - full resolution
+    int keypoints;
+};
+
+struct PairQuality
+{
+    int level = 0;
+    int matches = 0;
+    int inliers = 0;
+    double consistency = 0;
+    double ms = 0;
+    bool weak = false;
+    bool expired = false;
+};
+
+/*
+ * The const members (PrepareFrame, StitchPair, Stitch) keep no per-request
+ * state, so one configured Stitcher can serve concurrent requests. The
+ * StitchNext/StitchToLastResult family drives a single stateful sequence.
+ */
 class Stitcher
 {
 public:
@@ -21,12 +74,74 @@ public:
             cv::Mat* result);
     void StitchToLastResult(cv::Mat* newImg, cv::Mat* result);
     void StitchToLastResult(const std::string& newImg, cv::Mat* result);
+    void StitchToLastResult(StitchFrame& frame, cv::Mat* result);
+    bool StitchNext(cv::Mat* newImg, cv::Mat* result);
+    bool StitchNext(const std::string& newImg, cv::Mat* result);
+    bool StitchNext(StitchFrame& frame, cv::Mat* result);
+    void EndSequence();
+    cv::Mat Stitch(const std::vector<ImageView>& images) const;
+    cv::Mat StitchFrames(std::vector<StitchFrame>& frames) const;
+    bool FoldFrame(StitchFrame& mosaic, StitchFrame& frame, size_t index)
+        const;
+    void PrepareFrame(const std::string& path, StitchFrame& frame) const;
+    void PrepareFrame(const std::string& path, const cv::Mat& motion,
+            StitchFrame& frame) const;
+    void PrepareFrame(const ImageView& view, StitchFrame& frame) const;
+    bool StitchPair(const StitchFrame& left, const StitchFrame& right,
+            StitchFrame& merged) const;
     void SaveFile(const std::string& dir, const std::string& file,
             cv::Mat* result);
+    void SetFeatureCache(FeatureCache* cache);
+    void SetImageSource(ImageSource* source);
+    void SetDetectorType(DetectorType detectorType);
+    void SetMatcherType(MatcherType matcherType);
+    void SetWriter(AsyncWriter* writer);
+    void SetWorkResolution(float megapix, bool refine);
+    void SetOverlap(float overlap);
+    void SetCompositing(bool composite);
+    void SetFeather(int featherWidth);
+    void SetEstimator(const EstimatorParams& estimator);
+    void SetGrid(int gridSize);
+    void SetDeadline(double milliseconds);
+    bool Expired() const;
+    std::vector<PairQuality> Qualities() const;
+    QualityLevel Level(int level) const;
+    const RigCalibration& Rig() const;
+    cv::Mat Motion() const;
+    bool WriteState(cv::FileStorage& storage, const std::string& dir)
+        const;
+    bool ReadState(const cv::FileNode& node, const std::string& dir,
+            cv::Mat* result);
 
 private:
+    cv::Mat readImage(const std::string& path) const;
+    void detectionRois(const cv::Size& size, const cv::Mat& motion,
+            RectVec& rois) const;
+    void detect(const ImageProcessing& proc, const cv::Mat& img,
+            const std::string& path, ImageFeatures& features,
+            const RectVec& rois = RectVec()) const;
+    void detect(const ImageProcessing& proc, const cv::Mat& img,
+            const std::string& path, ImageFeatures& features,
+            const RectVec& rois, int level, float imageScale = 1.0f) const;
+    float workScale(const cv::Mat& img, float megapix) const;
+    int startLevel() const;
+    bool estimate(const ImageProcessing& proc, const cv::Mat& img1,
+            const cv::Mat& img2, const ImageFeatures& img1Features,
+            const ImageFeatures& img2Features, cv::Mat& homography,
+            float imageScale1 = 1.0f, float imageScale2 = 1.0f) const;
+    bool estimateLevel(const ImageProcessing& proc, const cv::Mat& img1,
+            const cv::Mat& img2, const ImageFeatures& img1Features,
+            const ImageFeatures& img2Features, cv::Mat& homography,
+            EstimationStats& stats, bool refine) const;
+    bool escalate(const cv::Mat& img1, const cv::Mat& img2, int level,
+            double attemptMs) const;
+    void record(const PairQuality& quality) const;
     void stitch(const ImageProcessing& proc, const cv::Mat& img1,
-            const cv::Mat& img2, const cv::Mat& gray1, const cv::Mat& gray2,
+            const cv::Mat& img2, const ImageFeatures& img1Features,
+            const ImageFeatures& img2Features, cv::Mat& result);
+    void stitch(const cv::Mat& img1, const std::string& path1,
+            const cv::Mat& img2, const std::string& path2, cv::Mat& result);
+    bool chain(const ImageProcessing& proc, StitchFrame& frame,
             cv::Mat& result);
 
 private:
@@ -34,6 +149,32 @@ private:
     float m_distanceRatio;
     float m_ransacValue;
     cv::Mat* m_lastStitched;
+    ImageFeatures m_prevFeatures;
+    cv::Mat m_prevImage;
+    float m_prevScale;
+    std::string m_prevPath;
+    cv::Mat m_prevHomography;
+    RigCalibration m_rig;
+    MosaicCanvas m_canvas;
+    FeatureCache* m_featureCache;
+    ImageSource* m_imageSource;
+    DetectorType m_detectorType;
+    MatcherType m_matcherType;
+    AsyncWriter* m_writer;
+    float m_workMegapix;
+    bool m_bRefine;
+    float m_overlap;
+    bool m_bComposite;
+    int m_featherWidth;
+    EstimatorParams m_estimator;
+    int m_gridSize;
+    cv::Mat m_motion;
+    mutable std::mutex m_motionMutex;
+    bool m_bBudget;
+    std::chrono::steady_clock::time_point m_deadline;
+    mutable double m_detectMsPerMp;
+    mutable std::vector<PairQuality> m_qualities;
+    mutable std::mutex m_qualityMutex;
 };
 
 #endif // __IMAGE_STITCHING_HXX__
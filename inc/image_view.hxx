@@ -0,0 +1,27 @@
+#ifndef __IMAGE_VIEW_HXX__
+#define __IMAGE_VIEW_HXX__
+
+#include <cstddef>
+
+namespace cv {
+    class Mat;
+}; // cv
+
+/*
+ * Non-owning view of a caller-owned 8-bit interleaved image (BGR, gray or
+ * BGRA). The buffer must stay valid for the duration of the call it is
+ * passed to. BGR views are wrapped without copying.
+ */
+struct ImageView
+{
+    const unsigned char* data = nullptr;
+    int width = 0;
+    int height = 0;
+    size_t stride = 0; // bytes per row, 0 - tightly packed
+    int channels = 3;
+
+    bool empty() const;
+    cv::Mat Wrap() const;
+};
+
+#endif // __IMAGE_VIEW_HXX__
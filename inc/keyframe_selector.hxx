@@ -0,0 +1,41 @@
+#ifndef __KEYFRAME_SELECTOR_HXX__
+#define __KEYFRAME_SELECTOR_HXX__
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+/*
+ * Picks the stitching keyframes out of a frame stream. Corners are tracked
+ * with pyramidal Lucas-Kanade on a downscaled gray copy of every frame and
+ * the motion since the last keyframe is a similarity fitted to the tracks,
+ * so a frame costs a fraction of a feature detection. A frame becomes a
+ * keyframe when the last keyframe covers less than minOverlap of it or
+ * when tracking is lost. Only the previous frame and the tracks are kept,
+ * memory does not depend on the stream length.
+ */
+class KeyframeSelector
+{
+public:
+    explicit KeyframeSelector(double minOverlap);
+    ~KeyframeSelector() = default;
+
+public:
+    bool Push(const cv::Mat& frame);
+    double Overlap() const;
+
+private:
+    void startKeyframe(const cv::Mat& gray);
+    void addCorners(const cv::Mat& gray, const cv::Mat& motion);
+    double overlap(const cv::Mat& motion, const cv::Size& size) const;
+
+private:
+    double m_minOverlap;
+    double m_overlap;
+    double m_scale;
+    cv::Mat m_prevGray;
+    std::vector<cv::Point2f> m_origins; // track starts in the keyframe
+    std::vector<cv::Point2f> m_points; // track ends in the previous frame
+};
+
+#endif // __KEYFRAME_SELECTOR_HXX__
@@ -1,8 +1,14 @@
 #ifndef __LOGGING_HXX__
 #define __LOGGING_HXX__
 
+#include <atomic>
 #include <ostream>
 
+// Records below this level are compiled out (0 - info, 1 - warn, 2 - error)
+#ifndef LOGGING_MIN_LEVEL
+#define LOGGING_MIN_LEVEL 0
+#endif
+
 enum class LogType
 {
     INFO,
@@ -10,20 +16,77 @@ enum class LogType
     ERROR
 };
 
+enum class LogFormat
+{
+    TEXT,
+    KEY_VALUE,
+    JSON
+};
+
+/*
+ * Callers only format the message into a slot of a bounded lock-free queue,
+ * a background thread writes the records out in batches and flushes once
+ * per batch. A filtered out record costs one relaxed load, or nothing below
+ * LOGGING_MIN_LEVEL. Flush waits until everything logged so far is written.
+ * Call through the LOG_* macros, they check the level before evaluating
+ * the arguments.
+ */
 class Logging
 {
 public:
-    static void Log(LogType type, const char* format, ...);
-    static void LogInfo(const char* format, ...);
-    static void LogWarn(const char* format, ...);
-    static void LogError(const char* format, ...);
+    template <typename... Args>
+    static void Log(LogType type, const char* format, Args... args)
+    {
+        if ( Enabled(type) )
+        {
+            write(type, format, args...);
+        }
+    }
+    template <typename... Args>
+    static void LogInfo(const char* format, Args... args)
+    {
+        Log(LogType::INFO, format, args...);
+    }
+    template <typename... Args>
+    static void LogWarn(const char* format, Args... args)
+    {
+        Log(LogType::WARN, format, args...);
+    }
+    template <typename... Args>
+    static void LogError(const char* format, Args... args)
+    {
+        Log(LogType::ERROR, format, args...);
+    }
+    static bool Enabled(LogType type)
+    {
+        int level = static_cast<int>(type);
+        return level >= LOGGING_MIN_LEVEL
+            && level >= m_level.load(std::memory_order_relaxed);
+    }
     static void SetOutputStream(std::ostream* os);
     static void UnsetOutputStream();
+    static void SetLevel(LogType type);
+    static void SetFormat(LogFormat format);
     static void DisableLogging();
+    static void Flush();
 
 private:
-    static bool m_bDisabled;
-    static std::ostream* m_os;
+    static void write(LogType type, const char* format, ...);
+
+private:
+    static std::atomic<int> m_level;
 };
 
+#define LOG_AT(type, ...) \
+    do \
+    { \
+        if ( Logging::Enabled(type) ) \
+        { \
+            Logging::Log(type, __VA_ARGS__); \
+        } \
+    } while (0)
+#define LOG_INFO(...) LOG_AT(LogType::INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LogType::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LogType::ERROR, __VA_ARGS__)
+
 #endif // __LOGGING_HXX__
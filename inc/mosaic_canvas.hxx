@@ -0,0 +1,39 @@
+#ifndef __MOSAIC_CANVAS_HXX__
+#define __MOSAIC_CANVAS_HXX__
+
+#include <opencv2/core.hpp>
+
+#include "warp_kernel.hxx"
+
+/*
+ * Growing mosaic buffer with spare capacity around the used area, the 2D
+ * counterpart of vector capacity growth. The mosaic is a view (ROI) of a
+ * larger buffer; when it grows past the buffer on some side, the buffer is
+ * reallocated with headroom on that side, so reallocations and full copies
+ * are amortised and a step otherwise only touches the pixels of the image
+ * warped into it.
+ */
+class MosaicCanvas
+{
+public:
+    MosaicCanvas() = default;
+    ~MosaicCanvas() = default;
+
+public:
+    void Reset(const cv::Mat& image);
+    void Resize(const cv::Point& offset, const cv::Size& size);
+    void Warp(const cv::Mat& image, const cv::Mat& homography);
+    cv::Mat View() const;
+    bool Shares(const cv::Mat& image) const;
+    void SetFeather(int featherWidth);
+
+private:
+    void reallocate(const cv::Rect& view);
+
+private:
+    cv::Mat m_buffer;
+    cv::Rect m_view;
+    WarpKernel m_warpKernel;
+};
+
+#endif // __MOSAIC_CANVAS_HXX__
@@ -0,0 +1,57 @@
+#ifndef __OVERLAP_GRAPH_HXX__
+#define __OVERLAP_GRAPH_HXX__
+
+#include <string>
+#include <vector>
+
+#include "image_features.hxx"
+
+class ThreadPool;
+class ImageSource;
+
+/*
+ * Stitching order for an unordered image set. Every image gets a global
+ * signature, a tf-idf bag-of-words histogram of the SIFT descriptors of a
+ * thumbnail (decoded reduced) over a vocabulary clustered from the set
+ * itself. Only the top-k most similar images are verified by matching
+ * thumbnail features, the verified inlier counts form the overlap graph,
+ * and the order is a depth first walk of its maximum spanning tree: every
+ * image overlaps one placed before it and a chain of images stays
+ * consecutive, but after a branch the next image overlaps an earlier one,
+ * not its predecessor. So the order suits stitching into the mosaic, not
+ * chain registration. Cost is n thumbnail detections and n * k small
+ * matches instead of n^2 full ones.
+ */
+class OverlapGraph
+{
+public:
+    OverlapGraph(ThreadPool& pool, ImageSource& source, int candidates);
+    ~OverlapGraph() = default;
+
+public:
+    bool Build(const std::vector<std::string>& files);
+    std::vector<size_t> Order() const;
+    size_t Edges() const;
+
+private:
+    struct Edge
+    {
+        size_t to;
+        int inliers;
+    };
+
+    bool describe(const std::string& path, ImageFeatures& features) const;
+    void signatures(const std::vector<ImageFeatures>& features,
+            cv::Mat& res) const;
+    int verify(const ImageFeatures& features1,
+            const ImageFeatures& features2) const;
+    void spanningTree(std::vector<size_t>& parents) const;
+
+private:
+    ThreadPool& m_pool;
+    ImageSource& m_source;
+    int m_candidates;
+    std::vector<std::vector<Edge>> m_edges;
+};
+
+#endif // __OVERLAP_GRAPH_HXX__
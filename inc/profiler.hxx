@@ -0,0 +1,57 @@
+#ifndef __PROFILER_HXX__
+#define __PROFILER_HXX__
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) \
+    ScopedTimer PROFILE_CONCAT(scopedTimer, __LINE__)(name)
+
+/*
+ * Collects per-stage timing events while enabled and writes them out as a
+ * Chrome trace (chrome://tracing, Perfetto). Every event also carries the
+ * resident set size at its end and the operator new allocations made on
+ * its thread while it ran (counted only when alloc_hooks is linked in).
+ * When disabled a scope or an allocation costs one flag check.
+ */
+class Profiler
+{
+public:
+    static void Enable();
+    static void EnableAllocationCounts();
+    static bool IsEnabled();
+    static void Record(const char* name, int64_t startUs, int64_t durationUs,
+            size_t allocations, size_t allocatedBytes);
+    static int64_t NowUs();
+    static bool WriteTrace(const std::string& path);
+    static void LogSummary();
+    static long CurrentRssKb();
+    static long PeakRssKb();
+    static void CountAllocation(size_t size);
+    static size_t ThreadAllocations();
+    static size_t ThreadAllocatedBytes();
+    static size_t TotalAllocations();
+    static size_t TotalAllocatedBytes();
+};
+
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(const char* name);
+    ~ScopedTimer();
+
+    ScopedTimer(ScopedTimer&&) = delete;
+    ScopedTimer(const ScopedTimer&) = delete;
+
+private:
+    const char* m_name;
+    int64_t m_startUs;
+    size_t m_startAllocations;
+    size_t m_startAllocatedBytes;
+};
+
+#endif // __PROFILER_HXX__
@@ -0,0 +1,55 @@
+#ifndef __RIG_CALIBRATION_HXX__
+#define __RIG_CALIBRATION_HXX__
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+/*
+ * Geometry of a fixed camera rig: for every camera position the homography
+ * into the output canvas and the expected input size. Once calibrated the
+ * rig is stitched by remapping only. BuildMaps() precomputes a fixed-point
+ * remap table per view, restricted to the part of the canvas the view
+ * covers, and Apply() composites a frame set through those tables.
+ */
+class RigCalibration
+{
+public:
+    RigCalibration() = default;
+    ~RigCalibration() = default;
+
+public:
+    void Reset();
+    void AddView(const cv::Mat& homography, const cv::Size& size);
+    void Translate(const cv::Point& offset);
+    void SetCanvasSize(const cv::Size& size);
+    void Write(cv::FileStorage& fs) const;
+    void Read(const cv::FileNode& node);
+    bool Save(const std::string& path) const;
+    bool Load(const std::string& path);
+    void BuildMaps();
+    bool Apply(const std::vector<cv::Mat>& images, cv::Mat& result) const;
+    size_t ViewsCount() const;
+    const cv::Size& CanvasSize() const;
+    const cv::Mat& ViewHomography(size_t index) const;
+    const cv::Size& ViewSize(size_t index) const;
+
+private:
+    struct View
+    {
+        cv::Mat homography;
+        cv::Size size;
+        cv::Rect roi;
+        cv::Mat mapXY;
+        cv::Mat mapInterpolation;
+    };
+
+    void buildMap(View& view) const;
+
+private:
+    cv::Size m_canvasSize;
+    std::vector<View> m_views;
+};
+
+#endif // __RIG_CALIBRATION_HXX__
@@ -17,6 +17,11 @@ namespace cv {
 }; // cv
 
 class Stitcher;
+class FeatureCache;
+class ImageSource;
+class ThreadPool;
+class AsyncWriter;
+class BatchRunner;
 
 namespace fs = boost::filesystem;
 namespace po = boost::program_options;
@@ -43,23 +48,87 @@ private:
     void saveFile(const std::string& filename, cv::Mat& image);
     void stitch(ImageNames& inputFiles);
     void stitchImages(ImageNames& inputFiles);
+    void stitchChain(ImageNames& inputFiles);
+    int chainFiles(const ImageNames& files, cv::Mat& result, int index,
+            ImageNames& stitched);
+    void saveProject(const ImageNames& files, int count);
+    void appendImages(ImageNames& inputFiles);
+    void stitchTree(ImageNames& inputFiles);
+    void composeTiles(ImageNames& inputFiles);
+    void saveRig();
+    void applyRig();
+    int runBatch();
+    void pollSpool(BatchRunner& runner);
     void stitch2Images(const std::string& src1, const std::string& src2);
+    std::string resultName(const std::string& stem) const;
+    bool isSaveStep(int index, bool last) const;
+    void initStitcher();
     void initLogging();
     void checkForOutputDir();
     void loadFiles(ImageNames& inputFiles);
+    void autoOrder(ImageNames& inputFiles);
+    void stitchVideo();
+    bool deadlineExceeded(int stitched, size_t total);
+    void logQualities() const;
+    void flushResults();
     void closeLogfile();
 
 private:
     bool m_bQuiet;
     bool m_bRecurseSearching;
+    bool m_bChain;
+    bool m_bTree;
+    bool m_bAppend;
+    bool m_bAutoOrder;
+    bool m_bRefine;
+    bool m_bLocalOptim;
+    bool m_bExpired;
     int m_keypointsCount;
     float m_distanceRatio;
     float m_ransacValue;
+    float m_workMegapix;
+    float m_overlap;
+    double m_keyframeOverlap;
+    double m_confidence;
+    int m_maxIters;
+    double m_deadline;
+    int m_threadsCount;
+    int m_prefetchCount;
+    int m_tileSize;
+    int m_featherWidth;
+    int m_gridSize;
+    int m_candidates;
+    int m_maxJobs;
+    int m_saveEvery;
+    int m_jpegQuality;
+    int m_pngCompression;
+    int m_memoryCap;
+    int m_decodeCache;
     std::string m_inputPath;
     std::string m_outputPath;
     std::string m_logfilePath;
+    std::string m_cachePath;
+    std::string m_detector;
+    std::string m_matcher;
+    std::string m_estimator;
+    std::string m_videoPath;
+    std::string m_calibratePath;
+    std::string m_applyPath;
+    std::string m_tracePath;
+    std::string m_batchPath;
+    std::string m_spoolPath;
+    std::string m_statusPath;
+    std::string m_format;
+    std::string m_logFormat;
+    std::string m_logLevel;
+    std::string m_resultExt;
+    std::vector<int> m_encodeParams;
     std::ofstream* m_logfileStream;
     Stitcher* m_stitcher;
+    FeatureCache* m_featureCache;
+    ImageSource* m_imageSource;
+    ThreadPool* m_pool;
+    AsyncWriter* m_writer;
 };
 
 #endif // __STITCH_APP_HXX__
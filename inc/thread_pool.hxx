@@ -0,0 +1,68 @@
+#ifndef __THREAD_POOL_HXX__
+#define __THREAD_POOL_HXX__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed set of work-stealing worker threads. Each worker owns a task deque:
+ * tasks submitted from a worker go to its own deque and are taken back
+ * newest first, idle workers steal the oldest tasks of the others, and
+ * tasks from outside the pool are spread round robin. Submit() returns a
+ * future so the caller decides how far ahead of the consumer the work is
+ * allowed to run.
+ */
+class ThreadPool
+{
+public:
+    explicit ThreadPool(size_t threadsCount = 0);
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool&&) = delete;
+    ThreadPool(const ThreadPool&) = delete;
+
+public:
+    template <typename F>
+    auto Submit(F&& task) -> std::future<decltype(task())>;
+    size_t Size() const;
+
+private:
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void enqueue(std::function<void()> task);
+    bool popTask(size_t index, std::function<void()>& task);
+    void workerLoop(size_t index);
+
+private:
+    bool m_bStopping;
+    size_t m_pending;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::atomic<size_t> m_nextQueue;
+    std::vector<std::unique_ptr<WorkQueue>> m_queues;
+    std::vector<std::thread> m_workers;
+};
+
+template <typename F>
+auto ThreadPool::Submit(F&& task) -> std::future<decltype(task())>
+{
+    typedef decltype(task()) Result;
+    auto packaged = std::make_shared<std::packaged_task<Result()>>(
+            std::forward<F>(task));
+    std::future<Result> future = packaged->get_future();
+    enqueue([packaged]() { (*packaged)(); });
+    return future;
+}
+
+#endif // __THREAD_POOL_HXX__
@@ -0,0 +1,53 @@
+#ifndef __TIFF_WRITER_HXX__
+#define __TIFF_WRITER_HXX__
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace cv {
+    class Mat;
+}; // cv
+
+/*
+ * Streaming writer of tiled, uncompressed 8-bit RGB BigTIFF files. Tiles
+ * are appended as soon as they are produced and only their offsets are
+ * kept, the directory is written by Close(), so the whole image never has
+ * to be in memory. BigTIFF offsets are 64-bit, there is no 4 GB limit.
+ */
+class TiffWriter
+{
+public:
+    TiffWriter();
+    ~TiffWriter();
+
+    TiffWriter(TiffWriter&&) = delete;
+    TiffWriter(const TiffWriter&) = delete;
+
+public:
+    bool Open(const std::string& path, int width, int height, int tileSize);
+    bool WriteTile(int tileX, int tileY, const cv::Mat& tile);
+    bool Close();
+    int TilesAcross() const;
+    int TilesDown() const;
+
+private:
+    void writeU16(uint16_t value);
+    void writeU64(uint64_t value);
+    void writeEntry(uint16_t tag, uint16_t type, uint64_t count,
+            uint64_t value);
+    uint64_t writeArray(const std::vector<uint64_t>& values);
+
+private:
+    std::ofstream m_os;
+    std::string m_path;
+    int m_width;
+    int m_height;
+    int m_tileSize;
+    std::vector<uint64_t> m_tileOffsets;
+    std::vector<uint64_t> m_tileByteCounts;
+    std::vector<char> m_buffer;
+};
+
+#endif // __TIFF_WRITER_HXX__
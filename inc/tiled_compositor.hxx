@@ -0,0 +1,50 @@
+#ifndef __TILED_COMPOSITOR_HXX__
+#define __TILED_COMPOSITOR_HXX__
+
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+class ThreadPool;
+class RigCalibration;
+
+/*
+ * Composites registered images tile by tile straight into a tiled TIFF.
+ * Each tile only inverse-maps the source pixels that land in it, tiles of a
+ * row are rendered in parallel and written in order as they complete. For
+ * every tile row each source crossing it is decoded on the pool and only
+ * the strip of it that maps into the row is kept, so peak memory is the
+ * strips of one tile row, a window of tiles and one decoded source per
+ * thread, independent of the mosaic size and of the source count. The
+ * price is that a source is decoded once per tile row it crosses.
+ */
+class TiledCompositor
+{
+public:
+    TiledCompositor(ThreadPool& pool, int tileSize);
+    ~TiledCompositor() = default;
+
+public:
+    bool Compose(const std::vector<std::string>& files,
+            const RigCalibration& rig, const std::string& outputPath) const;
+
+private:
+    struct Strip
+    {
+        cv::Mat image;
+        cv::Mat homography; // strip to canvas
+    };
+
+    void composeTile(const std::vector<Strip>& strips,
+            const std::vector<cv::Rect>& bounds, const cv::Rect& tile,
+            cv::Mat& res) const;
+    static Strip loadStrip(const std::string& file, const cv::Mat& homography,
+            const cv::Rect& area);
+
+private:
+    ThreadPool& m_pool;
+    int m_tileSize;
+};
+
+#endif // __TILED_COMPOSITOR_HXX__
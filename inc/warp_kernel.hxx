@@ -0,0 +1,36 @@
+#ifndef __WARP_KERNEL_HXX__
+#define __WARP_KERNEL_HXX__
+
+namespace cv {
+    class Mat;
+}; // cv
+
+/*
+ * Perspective warp of an 8-bit BGR image onto a destination it is
+ * composited into. Only the rows and the per-row span covered by the
+ * warped quadrilateral are visited, rows run in parallel, and bilinear
+ * sampling is vectorised with AVX2 or SSE4.1 (picked at runtime, scalar
+ * fallback). Pixels outside the source leave the destination as it is.
+ * With a feather width the source fades in over that many pixels from its
+ * border wherever the destination is already covered (non-zero), in the
+ * same pass; otherwise source pixels overwrite the destination.
+ */
+class WarpKernel
+{
+public:
+    explicit WarpKernel(int featherWidth = 0);
+    ~WarpKernel() = default;
+
+public:
+    void Warp(const cv::Mat& src, cv::Mat& dst,
+            const cv::Mat& homography) const;
+    void SetFeatherWidth(int featherWidth);
+    void SetSimd(bool enabled);
+    const char* InstructionSet() const;
+
+private:
+    int m_featherWidth;
+    bool m_bSimd;
+};
+
+#endif // __WARP_KERNEL_HXX__
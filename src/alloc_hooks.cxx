@@ -0,0 +1,47 @@
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "profiler.hxx"
+
+/*
+ * Replaces the global operator new to feed the profiler allocation
+ * counters. Linked into the executables only, never into the library, so
+ * an embedding process keeps its own allocator.
+ */
+
+void* operator new(size_t size)
+{
+    Profiler::CountAllocation(size);
+    void* ptr = std::malloc(std::max<size_t>(1, size));
+    if (nullptr == ptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
@@ -0,0 +1,87 @@
+#include <opencv2/opencv.hpp>
+
+#include "async_writer.hxx"
+#include "logging.hxx"
+#include "profiler.hxx"
+
+AsyncWriter::AsyncWriter(size_t maxPending, const std::vector<int>& params)
+    : m_bStopping(false)
+    , m_maxPending(std::max<size_t>(1, maxPending))
+    , m_inProgress(0)
+    , m_params(params)
+{
+    m_thread = std::thread(&AsyncWriter::writerLoop, this);
+}
+
+AsyncWriter::~AsyncWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bStopping = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+}
+
+void AsyncWriter::Write(const std::string& path, const cv::Mat& image)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]() { return m_jobs.size() < m_maxPending; });
+    m_jobs.push_back({ path, image });
+    m_cv.notify_all();
+}
+
+void AsyncWriter::Flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]() {
+        return m_jobs.empty() && 0 == m_inProgress;
+    });
+}
+
+void AsyncWriter::writerLoop()
+{
+    for (;;)
+    {
+        WriteJob job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() {
+                return m_bStopping || !m_jobs.empty();
+            });
+            if (m_jobs.empty())
+            {
+                return;
+            }
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            ++m_inProgress;
+            m_cv.notify_all();
+        }
+        bool written = false;
+        // An encoder error must not end the writer, Flush waits for it
+        try
+        {
+            PROFILE_SCOPE("encode");
+            written = cv::imwrite(job.path, job.image, m_params);
+        }
+        catch (const std::exception& e)
+        {
+            LOG_ERROR("Encoder failed: %s", e.what());
+        }
+        if (!written)
+        {
+            LOG_ERROR("Failed to write result file: %s",
+                    job.path.c_str());
+        }
+        else
+        {
+            LOG_INFO("Result file is saved: %s", job.path.c_str());
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_inProgress;
+        }
+        m_cv.notify_all();
+    }
+}
@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <sstream>
+
+#include <opencv2/opencv.hpp>
+#include <boost/filesystem.hpp>
+
+#include "batch_runner.hxx"
+#include "image_stitching.hxx"
+#include "thread_pool.hxx"
+#include "profiler.hxx"
+#include "logging.hxx"
+
+namespace fs = boost::filesystem;
+
+static const std::chrono::milliseconds MEMORY_POLL_INTERVAL(100);
+// Frames a job prepares ahead of the one being folded into its mosaic
+static const size_t PREPARE_AHEAD = 4;
+
+std::string jsonEscape(const std::string& str)
+{
+    std::string res;
+    for (char c : str)
+    {
+        if ('"' == c || '\\' == c)
+        {
+            res += '\\';
+        }
+        res += ('\n' == c) ? ' ' : c;
+    }
+    return res;
+}
+
+BatchRunner::BatchRunner(const Stitcher& stitcher, ThreadPool& pool,
+        size_t maxJobs, size_t memoryCapMb, const std::string& statusPath)
+    : m_stitcher(stitcher)
+    , m_pool(pool)
+    , m_memoryCapKb(memoryCapMb * 1024)
+    , m_extension(".jpg")
+    , m_bClosed(false)
+    , m_running(0)
+    , m_failed(0)
+{
+    if (!statusPath.empty())
+    {
+        m_status.open(statusPath, std::ios::app);
+        if (!m_status.is_open())
+        {
+            LOG_ERROR("Unable to open status file: %s",
+                    statusPath.c_str());
+        }
+    }
+    for (size_t i = 0; i < std::max<size_t>(1, maxJobs); ++i)
+    {
+        m_runners.emplace_back(&BatchRunner::runnerLoop, this);
+    }
+}
+
+BatchRunner::~BatchRunner()
+{
+    Finish();
+}
+
+bool BatchRunner::LoadManifest(const std::string& path, BatchJobs& jobs)
+{
+    std::ifstream is(path);
+    if (!is.is_open())
+    {
+        LOG_ERROR("Unable to read manifest: %s", path.c_str());
+        return false;
+    }
+    std::string line;
+    for (int lineNo = 1; std::getline(is, line); ++lineNo)
+    {
+        std::istringstream fields(line);
+        BatchJob job;
+        if (!(fields >> job.input) || '#' == job.input[0])
+        {
+            continue;
+        }
+        if (!(fields >> job.output))
+        {
+            LOG_ERROR("Manifest %s:%d: expected \"input output\"",
+                    path.c_str(), lineNo);
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+void BatchRunner::SetEncoder(const std::string& extension,
+        const std::vector<int>& params)
+{
+    m_extension = extension;
+    m_params = params;
+}
+
+void BatchRunner::Add(const BatchJob& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(job);
+    }
+    m_cv.notify_one();
+}
+
+size_t BatchRunner::Finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bClosed = true;
+    }
+    m_cv.notify_all();
+    for (auto& runner : m_runners)
+    {
+        runner.join();
+    }
+    m_runners.clear();
+    return m_failed;
+}
+
+bool BatchRunner::admissible() const
+{
+    return 0 == m_running || 0 == m_memoryCapKb
+        || static_cast<size_t>(Profiler::CurrentRssKb()) < m_memoryCapKb;
+}
+
+void BatchRunner::runnerLoop()
+{
+    for (;;)
+    {
+        BatchJob job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            for (;;)
+            {
+                if (m_jobs.empty())
+                {
+                    if (m_bClosed)
+                    {
+                        return;
+                    }
+                    m_cv.wait(lock);
+                    continue;
+                }
+                if (admissible())
+                {
+                    break;
+                }
+                // The resident set only shrinks as other jobs finish
+                m_cv.wait_for(lock, MEMORY_POLL_INTERVAL);
+            }
+            job = m_jobs.front();
+            m_jobs.pop_front();
+            ++m_running;
+        }
+        LOG_INFO("Job started: %s", job.input.c_str());
+        auto start = std::chrono::steady_clock::now();
+        size_t images = 0;
+        std::string error;
+        bool done = false;
+        // A bad job fails alone, the runner goes on with the next one
+        try
+        {
+            done = runJob(job, images, error);
+        }
+        catch (const std::exception& e)
+        {
+            error = e.what();
+        }
+        double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+        report(job, done, images, seconds, error);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_running;
+        }
+        m_cv.notify_all();
+    }
+}
+
+bool BatchRunner::runJob(const BatchJob& job, size_t& images,
+        std::string& error) const
+{
+    PROFILE_SCOPE("batch_job");
+    std::vector<std::string> files;
+    boost::system::error_code ec;
+    if (!fs::is_directory(job.input, ec))
+    {
+        error = "input is not a directory";
+        return false;
+    }
+    for (const auto& entry : fs::directory_iterator(job.input, ec))
+    {
+        if (fs::is_regular_file(entry.status()))
+        {
+            files.push_back(entry.path().string());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    images = files.size();
+    if (files.size() < 2)
+    {
+        error = "less than two images";
+        return false;
+    }
+    fs::create_directories(job.output, ec);
+    if (ec)
+    {
+        error = "unable to create output directory";
+        return false;
+    }
+    const Stitcher& stitcher = m_stitcher;
+    std::deque<std::future<StitchFrame>> prepared;
+    size_t next = 0;
+    StitchFrame mosaic;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        while (next < files.size() && prepared.size() < PREPARE_AHEAD)
+        {
+            const std::string& file = files[next++];
+            prepared.push_back(m_pool.Submit([&stitcher, file]() {
+                StitchFrame frame;
+                // Jobs are independent, none follows the chain motion
+                stitcher.PrepareFrame(file, cv::Mat(), frame);
+                return frame;
+            }));
+        }
+        StitchFrame frame = prepared.front().get();
+        prepared.pop_front();
+        stitcher.FoldFrame(mosaic, frame, i);
+    }
+    cv::Mat result = mosaic.image;
+    if (result.empty())
+    {
+        error = "no image could be stitched";
+        return false;
+    }
+    fs::path path = fs::path(job.output) / ("result" + m_extension);
+    PROFILE_SCOPE("encode");
+    if (!cv::imwrite(path.string(), result, m_params))
+    {
+        error = "unable to write " + path.string();
+        return false;
+    }
+    return true;
+}
+
+void BatchRunner::report(const BatchJob& job, bool done, size_t images,
+        double seconds, const std::string& error)
+{
+    if (done)
+    {
+        LOG_INFO("Job done in %.2f s: %s -> %s", seconds,
+                job.input.c_str(), job.output.c_str());
+    }
+    else
+    {
+        LOG_ERROR("Job failed (%s): %s", error.c_str(),
+                job.input.c_str());
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!done)
+    {
+        ++m_failed;
+    }
+    if (!m_status.is_open())
+    {
+        return;
+    }
+    m_status << "{\"input\":\"" << jsonEscape(job.input)
+        << "\",\"output\":\"" << jsonEscape(job.output)
+        << "\",\"status\":\"" << (done ? "done" : "failed")
+        << "\",\"images\":" << images
+        << ",\"seconds\":" << seconds
+        << ",\"rss_kb\":" << Profiler::CurrentRssKb()
+        << ",\"error\":\"" << jsonEscape(error) << "\"}" << std::endl;
+}
@@ -0,0 +1,269 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/opencv.hpp>
+#include <boost/filesystem.hpp>
+
+#include "feature_cache.hxx"
+#include "logging.hxx"
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+const char FEATURE_MAGIC[4] = { 'I', 'S', 'F', 'T' };
+const uint32_t FEATURE_VERSION = 2;
+const size_t DESCRIPTORS_ALIGNMENT = 64;
+
+struct FeatureHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t keypointsCount;
+    int32_t descriptorsRows;
+    int32_t descriptorsCols;
+    int32_t descriptorsType;
+    float scale;
+    uint64_t descriptorsOffset;
+};
+
+struct StoredKeyPoint
+{
+    float x;
+    float y;
+    float size;
+    float angle;
+    float response;
+    int32_t octave;
+    int32_t classId;
+};
+
+class MappedFile
+{
+public:
+    MappedFile(void* data, size_t size) : m_data(data), m_size(size) {}
+    ~MappedFile() { munmap(m_data, m_size); }
+
+    const char* data() const { return static_cast<const char*>(m_data); }
+    size_t size() const { return m_size; }
+
+private:
+    void* m_data;
+    size_t m_size;
+};
+
+std::shared_ptr<MappedFile> mapFile(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    struct stat st;
+    if (0 != fstat(fd, &st) || 0 == st.st_size)
+    {
+        close(fd);
+        return nullptr;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == data)
+    {
+        return nullptr;
+    }
+    return std::make_shared<MappedFile>(data, st.st_size);
+}
+
+size_t alignUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+/*
+ * Whether the keypoint and descriptor blocks the header describes lie
+ * within a file of fileSize bytes, checked before either is read so a
+ * truncated or corrupt entry is a cache miss.
+ */
+bool validHeader(const FeatureHeader& header, size_t fileSize)
+{
+    if (0 != std::memcmp(header.magic, FEATURE_MAGIC, sizeof(FEATURE_MAGIC))
+            || FEATURE_VERSION != header.version
+            || header.descriptorsRows != (int32_t)header.keypointsCount
+            || header.descriptorsRows < 0 || header.descriptorsCols <= 0
+            || (CV_8UC1 != header.descriptorsType
+                && CV_32FC1 != header.descriptorsType))
+    {
+        return false;
+    }
+    size_t keypointsEnd = sizeof(FeatureHeader)
+        + static_cast<size_t>(header.keypointsCount) * sizeof(StoredKeyPoint);
+    if (keypointsEnd > header.descriptorsOffset
+            || header.descriptorsOffset > fileSize)
+    {
+        return false;
+    }
+    size_t rowSize = static_cast<size_t>(header.descriptorsCols)
+        * CV_ELEM_SIZE(header.descriptorsType);
+    size_t available = fileSize - header.descriptorsOffset;
+    return 0 == header.descriptorsRows
+        || rowSize <= available / header.descriptorsRows;
+}
+
+} // namespace
+
+FeatureCache::FeatureCache(const std::string& dir)
+    : m_dir(dir)
+{
+    if (!fs::exists(m_dir))
+    {
+        fs::create_directories(m_dir);
+    }
+}
+
+uint64_t FeatureCache::hashBytes(const void* data, size_t size, uint64_t seed)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool FeatureCache::hashFile(const std::string& path, uint64_t& hash)
+{
+    std::shared_ptr<MappedFile> file = mapFile(path);
+    if (nullptr == file)
+    {
+        return false;
+    }
+    hash = hashBytes(file->data(), file->size());
+    return true;
+}
+
+std::string FeatureCache::MakeKey(const std::string& imagePath,
+        const std::string& params) const
+{
+    uint64_t contentHash = 0;
+    if (!hashFile(imagePath, contentHash))
+    {
+        return "";
+    }
+    uint64_t paramsHash = hashBytes(params.data(), params.size());
+    char key[40];
+    snprintf(key, sizeof(key), "%016llx-%016llx",
+            static_cast<unsigned long long>(contentHash),
+            static_cast<unsigned long long>(paramsHash));
+    return key;
+}
+
+std::string FeatureCache::entryPath(const std::string& key) const
+{
+    return (fs::path(m_dir) / (key + ".feat")).string();
+}
+
+bool FeatureCache::Load(const std::string& key, ImageFeatures& features) const
+{
+    if (key.empty())
+    {
+        return false;
+    }
+    std::shared_ptr<MappedFile> file = mapFile(entryPath(key));
+    if (nullptr == file || file->size() < sizeof(FeatureHeader))
+    {
+        return false;
+    }
+    FeatureHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (!validHeader(header, file->size()))
+    {
+        LOG_WARN("Ignoring invalid feature cache entry: %s",
+                key.c_str());
+        return false;
+    }
+    const StoredKeyPoint* stored = reinterpret_cast<const StoredKeyPoint*>(
+            file->data() + sizeof(FeatureHeader));
+    features.keypoints.resize(header.keypointsCount);
+    for (uint32_t i = 0; i < header.keypointsCount; ++i)
+    {
+        const StoredKeyPoint& kp = stored[i];
+        features.keypoints[i] = cv::KeyPoint(kp.x, kp.y, kp.size, kp.angle,
+                kp.response, kp.octave, kp.classId);
+    }
+    void* descData = const_cast<char*>(file->data())
+        + header.descriptorsOffset;
+    features.descriptors = cv::Mat(header.descriptorsRows,
+            header.descriptorsCols, header.descriptorsType, descData);
+    features.storage = file;
+    features.scale = header.scale;
+    return true;
+}
+
+bool FeatureCache::Store(const std::string& key,
+        const ImageFeatures& features) const
+{
+    if (key.empty() || features.empty())
+    {
+        return false;
+    }
+    cv::Mat descriptors = features.descriptors;
+    if (!descriptors.isContinuous())
+    {
+        descriptors = descriptors.clone();
+    }
+    FeatureHeader header;
+    std::memcpy(header.magic, FEATURE_MAGIC, sizeof(FEATURE_MAGIC));
+    header.version = FEATURE_VERSION;
+    header.keypointsCount = static_cast<uint32_t>(features.keypoints.size());
+    header.descriptorsRows = descriptors.rows;
+    header.descriptorsCols = descriptors.cols;
+    header.descriptorsType = descriptors.type();
+    header.scale = features.scale;
+    size_t keypointsEnd = sizeof(FeatureHeader)
+        + header.keypointsCount * sizeof(StoredKeyPoint);
+    header.descriptorsOffset = alignUp(keypointsEnd, DESCRIPTORS_ALIGNMENT);
+    std::vector<StoredKeyPoint> stored;
+    stored.reserve(features.keypoints.size());
+    for (const auto& kp : features.keypoints)
+    {
+        stored.push_back({ kp.pt.x, kp.pt.y, kp.size, kp.angle, kp.response,
+                kp.octave, kp.class_id });
+    }
+    std::string path = entryPath(key);
+    std::ostringstream tmpPath;
+    tmpPath << path << "." << getpid() << "."
+        << std::hash<std::thread::id>()(std::this_thread::get_id()) << ".tmp";
+    std::ofstream os(tmpPath.str(), std::ios::binary | std::ios::trunc);
+    if (!os.is_open())
+    {
+        LOG_WARN("Unable to write feature cache entry: %s",
+                tmpPath.str().c_str());
+        return false;
+    }
+    std::vector<char> padding(header.descriptorsOffset - keypointsEnd, 0);
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    os.write(reinterpret_cast<const char*>(stored.data()),
+            stored.size() * sizeof(StoredKeyPoint));
+    os.write(padding.data(), padding.size());
+    os.write(reinterpret_cast<const char*>(descriptors.data),
+            descriptors.total() * descriptors.elemSize());
+    os.close();
+    if (!os)
+    {
+        fs::remove(tmpPath.str());
+        return false;
+    }
+    fs::rename(tmpPath.str(), path);
+    return true;
+}
@@ -1,39 +1,309 @@
+#include <algorithm>
+#include <numeric>
+
 #include <opencv2/opencv.hpp>
 
 #include "image_processing.hxx"
+#include "logging.hxx"
+#include "profiler.hxx"
+
+static const double CLAHE_CLIP_LIMIT = 2.0;
+static const int CLAHE_GRID_SIZE = 8;
+static const size_t MIN_REFINE_MATCHES = 12;
+static const int HOMOGRAPHY_SAMPLE_SIZE = 4;
+// Grid bucketing: margin detected around a cell, smallest cell side and
+// candidates detected per cell relative to its budget
+static const int GRID_CELL_PADDING = 32;
+static const int GRID_MIN_CELL = 64;
+static const int GRID_CANDIDATES_FACTOR = 2;
+// Overlap consistency check resolution and smallest usable overlap
+static const double CONSISTENCY_MEGAPIX = 0.05;
+static const int MIN_CONSISTENCY_PIXELS = 200;
 
-ImageProcessing::ImageProcessing()
+/*
+ * OpenCV does not report the iterations a robust estimator ran. They stop
+ * once a minimal sample is all inliers with the requested confidence, so
+ * this is the textbook bound from the final inlier ratio, not a count.
+ */
+static int iterationsBound(int inliers, int matches,
+        const EstimatorParams& estimator)
+{
+    if (matches < HOMOGRAPHY_SAMPLE_SIZE || inliers <= 0)
+    {
+        return estimator.maxIters;
+    }
+    double allInliers = std::pow(static_cast<double>(inliers) / matches,
+            HOMOGRAPHY_SAMPLE_SIZE);
+    if (allInliers >= 1.0)
+    {
+        return 1;
+    }
+    double iterations = std::log(1.0 - estimator.confidence)
+        / std::log(1.0 - allInliers);
+    return static_cast<int>(std::min<double>(estimator.maxIters,
+                std::max(1.0, std::ceil(iterations))));
+}
+
+ImageProcessing::ImageProcessing(DetectorType detectorType,
+        MatcherType matcherType, int featherWidth,
+        const EstimatorParams& estimator, int gridSize)
     : m_clahe(cv::createCLAHE())
+    , m_detectorType(detectorType)
+    , m_matcherType(matcherType)
+    , m_estimator(estimator)
+    , m_gridSize(gridSize)
+    , m_warpKernel(featherWidth)
 {
 }
 
 void ImageProcessing::MakeGray(const cv::Mat& img, cv::Mat& res) const
 {
+    PROFILE_SCOPE("gray_clahe");
     cv::cvtColor(img, res, cv::COLOR_BGR2GRAY);
-    m_clahe->setClipLimit(2.0);
-    m_clahe->setTilesGridSize(cv::Size(8, 8));
+    m_clahe->setClipLimit(CLAHE_CLIP_LIMIT);
+    m_clahe->setTilesGridSize(cv::Size(CLAHE_GRID_SIZE, CLAHE_GRID_SIZE));
     m_clahe->apply(res, res);
 }
 
-void ImageProcessing::FindMatches(const cv::Mat& img1, const cv::Mat& img2,
-        DMatchVec& matches, KeyPoints& img1Keypoints, KeyPoints& img2Keypoints,
-        float ratio, int keypointsCount) const
+std::string ImageProcessing::FeatureParams(int keypointsCount) const
+{
+    std::string detector = "sift";
+    if (DetectorType::ORB == m_detectorType)
+    {
+        detector = "orb";
+    }
+    else if (DetectorType::AKAZE == m_detectorType)
+    {
+        detector = "akaze";
+    }
+    std::string params = detector + ":keypoints="
+        + std::to_string(keypointsCount)
+        + ":clahe=" + std::to_string(CLAHE_CLIP_LIMIT)
+        + "/" + std::to_string(CLAHE_GRID_SIZE);
+    if (m_gridSize > 1)
+    {
+        params += ":grid=" + std::to_string(m_gridSize);
+    }
+    return params;
+}
+
+cv::Ptr<cv::Feature2D> ImageProcessing::createDetector(
+        int keypointsCount) const
+{
+    switch (m_detectorType)
+    {
+    case DetectorType::ORB:
+        return cv::ORB::create(keypointsCount);
+    case DetectorType::AKAZE:
+        return cv::AKAZE::create();
+    case DetectorType::SIFT:
+    default:
+        return cv::SIFT::create(keypointsCount);
+    }
+}
+
+void ImageProcessing::DetectFeatures(const cv::Mat& img,
+        ImageFeatures& features, int keypointsCount) const
+{
+    PROFILE_SCOPE("detect");
+    int gridSize = std::min(m_gridSize, std::min(img.cols, img.rows)
+            / GRID_MIN_CELL);
+    if (gridSize > 1)
+    {
+        detectBucketed(img, gridSize, features, keypointsCount);
+        return;
+    }
+    cv::Ptr<cv::Feature2D> detector = createDetector(keypointsCount);
+    if (DetectorType::AKAZE != m_detectorType)
+    {
+        detector->detectAndCompute(img, cv::noArray(), features.keypoints,
+                features.descriptors);
+        return;
+    }
+    // AKAZE has no keypoint limit of its own, keep the strongest ones
+    detector->detect(img, features.keypoints);
+    cv::KeyPointsFilter::retainBest(features.keypoints, keypointsCount);
+    detector->compute(img, features.keypoints, features.descriptors);
+}
+
+void ImageProcessing::DetectFeatures(const cv::Mat& img,
+        ImageFeatures& features, int keypointsCount,
+        const RectVec& rois) const
 {
-    cv::Mat img1Desc;
-    cv::Mat img2Desc;
-    cv::BFMatcher matcher(cv::NORM_L2);
+    if (rois.empty())
+    {
+        DetectFeatures(img, features, keypointsCount);
+        features.partial = false;
+        return;
+    }
+    double totalArea = static_cast<double>(img.cols) * img.rows;
+    std::vector<cv::Mat> descriptors;
+    features.keypoints.clear();
+    for (const auto& roi : rois)
+    {
+        // Every region gets a share of the budget matching its area
+        int budget = std::max(1, static_cast<int>(keypointsCount
+                    * (static_cast<double>(roi.area()) / totalArea)));
+        ImageFeatures roiFeatures;
+        DetectFeatures(img(roi), roiFeatures, budget);
+        if (roiFeatures.empty())
+        {
+            continue;
+        }
+        for (auto& kp : roiFeatures.keypoints)
+        {
+            kp.pt += cv::Point2f((float)roi.x, (float)roi.y);
+            features.keypoints.push_back(kp);
+        }
+        descriptors.push_back(roiFeatures.descriptors);
+    }
+    features.descriptors.release();
+    if (!descriptors.empty())
+    {
+        cv::vconcat(descriptors, features.descriptors);
+    }
+    features.partial = true;
+}
+
+/*
+ * Every cell of a gridSize x gridSize grid keeps its strongest keypoints up
+ * to an equal share of the budget, the share left by weakly textured cells
+ * goes to the strongest remaining candidates anywhere. Cells are detected
+ * in parallel with a margin so keypoints on cell borders are not lost, the
+ * descriptors are computed once on the whole image.
+ */
+void ImageProcessing::detectBucketed(const cv::Mat& img, int gridSize,
+        ImageFeatures& features, int keypointsCount) const
+{
+    int cells = gridSize * gridSize;
+    int budget = std::max(1, keypointsCount / cells);
+    std::vector<KeyPoints> candidates(cells);
+    cv::Rect bounds(0, 0, img.cols, img.rows);
+    cv::parallel_for_(cv::Range(0, cells), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; ++i)
+        {
+            int col = i % gridSize;
+            int row = i / gridSize;
+            int x0 = col * img.cols / gridSize;
+            int y0 = row * img.rows / gridSize;
+            int x1 = (col + 1) * img.cols / gridSize;
+            int y1 = (row + 1) * img.rows / gridSize;
+            cv::Rect padded = cv::Rect(x0 - GRID_CELL_PADDING,
+                    y0 - GRID_CELL_PADDING,
+                    x1 - x0 + 2 * GRID_CELL_PADDING,
+                    y1 - y0 + 2 * GRID_CELL_PADDING) & bounds;
+            KeyPoints keypoints;
+            createDetector(budget * GRID_CANDIDATES_FACTOR)->detect(
+                    img(padded), keypoints);
+            KeyPoints& inside = candidates[i];
+            for (auto& kp : keypoints)
+            {
+                kp.pt += cv::Point2f((float)padded.x, (float)padded.y);
+                if (kp.pt.x >= x0 && kp.pt.x < x1
+                        && kp.pt.y >= y0 && kp.pt.y < y1)
+                {
+                    inside.push_back(kp);
+                }
+            }
+            std::sort(inside.begin(), inside.end(),
+                    [](const cv::KeyPoint& a, const cv::KeyPoint& b) {
+                return a.response > b.response;
+            });
+        }
+    });
+    features.keypoints.clear();
+    KeyPoints spare;
+    for (const auto& cell : candidates)
+    {
+        size_t keep = std::min(cell.size(), static_cast<size_t>(budget));
+        features.keypoints.insert(features.keypoints.end(), cell.begin(),
+                cell.begin() + keep);
+        spare.insert(spare.end(), cell.begin() + keep, cell.end());
+    }
+    int left = keypointsCount - static_cast<int>(features.keypoints.size());
+    if (left > 0 && !spare.empty())
+    {
+        cv::KeyPointsFilter::retainBest(spare, left);
+        features.keypoints.insert(features.keypoints.end(), spare.begin(),
+                spare.end());
+    }
+    createDetector(keypointsCount)->compute(img, features.keypoints,
+            features.descriptors);
+}
+
+cv::Ptr<cv::DescriptorMatcher> ImageProcessing::createMatcher(
+        int descriptorsType) const
+{
+    bool binary = (CV_8U == descriptorsType);
+    switch (m_matcherType)
+    {
+    case MatcherType::KDTREE:
+        if (!binary)
+        {
+            return cv::makePtr<cv::FlannBasedMatcher>(
+                    cv::makePtr<cv::flann::KDTreeIndexParams>(4),
+                    cv::makePtr<cv::flann::SearchParams>(32));
+        }
+        LOG_WARN("KD-tree needs float descriptors, using LSH");
+        [[fallthrough]];
+    case MatcherType::LSH:
+        if (binary)
+        {
+            return cv::makePtr<cv::FlannBasedMatcher>(
+                    cv::makePtr<cv::flann::LshIndexParams>(12, 20, 2),
+                    cv::makePtr<cv::flann::SearchParams>(32));
+        }
+        LOG_WARN("LSH needs binary descriptors, using KD-tree");
+        return cv::makePtr<cv::FlannBasedMatcher>(
+                cv::makePtr<cv::flann::KDTreeIndexParams>(4),
+                cv::makePtr<cv::flann::SearchParams>(32));
+    case MatcherType::BRUTE_FORCE:
+    default:
+        return cv::BFMatcher::create(binary ? cv::NORM_HAMMING : cv::NORM_L2);
+    }
+}
+
+void ImageProcessing::BuildIndex(const ImageFeatures& features) const
+{
+    if (nullptr != features.index)
+    {
+        return;
+    }
+    PROFILE_SCOPE("build_index");
+    cv::Mat desc = features.descriptors;
+    if (desc.type() != CV_32F && desc.type() != CV_8U)
+    {
+        desc.convertTo(desc, CV_32F);
+    }
+    cv::Ptr<cv::DescriptorMatcher> index = createMatcher(desc.type());
+    index->add(std::vector<cv::Mat>{ desc });
+    index->train();
+    features.index = index;
+}
+
+void ImageProcessing::MatchFeatures(const ImageFeatures& img1Features,
+        const ImageFeatures& img2Features, DMatchVec& matches,
+        float ratio) const
+{
+    cv::Mat img1Desc = img1Features.descriptors;
     std::vector<DMatchVec> initialMatches;
-    cv::Ptr<cv::SIFT> detector = cv::SIFT::create(keypointsCount);
-    detector->detectAndCompute(img1, cv::noArray(), img1Keypoints, img1Desc);
-    detector->detectAndCompute(img2, cv::noArray(), img2Keypoints, img2Desc);
-    if (img1Desc.type() != CV_32F)
+    if (img1Features.empty() || img2Features.empty())
+    {
+        return;
+    }
+    if (img1Desc.type() != CV_32F && img1Desc.type() != CV_8U)
     {
         img1Desc.convertTo(img1Desc, CV_32F);
-        img2Desc.convertTo(img2Desc, CV_32F);
     }
-    matcher.knnMatch(img1Desc, img2Desc, initialMatches, 2);
+    BuildIndex(img2Features);
+    PROFILE_SCOPE("knn_match");
+    img2Features.index->knnMatch(img1Desc, initialMatches, 2);
     for (const auto& m : initialMatches)
     {
+        if (m.size() < 2)
+        {
+            continue;
+        }
         if (m[0].distance < ratio * m[1].distance)
         {
             matches.push_back(m[0]);
@@ -41,44 +311,262 @@ void ImageProcessing::FindMatches(const cv::Mat& img1, const cv::Mat& img2,
     }
 }
 
+void ImageProcessing::FindMatches(const cv::Mat& img1, const cv::Mat& img2,
+        DMatchVec& matches, KeyPoints& img1Keypoints, KeyPoints& img2Keypoints,
+        float ratio, int keypointsCount) const
+{
+    ImageFeatures img1Features;
+    ImageFeatures img2Features;
+    DetectFeatures(img1, img1Features, keypointsCount);
+    DetectFeatures(img2, img2Features, keypointsCount);
+    MatchFeatures(img1Features, img2Features, matches, ratio);
+    img1Keypoints = std::move(img1Features.keypoints);
+    img2Keypoints = std::move(img2Features.keypoints);
+}
+
 void ImageProcessing::TransformHomography(const KeyPoints& img1Keypoints,
         const KeyPoints& img2Keypoints, const DMatchVec& matches,
-        cv::Mat& homography, float ransacVal) const
+        cv::Mat& homography, float ransacVal, EstimationStats* stats) const
 {
+    // Best matches first, PROSAC draws its samples in this order
+    std::vector<size_t> order(matches.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+            [&matches](size_t a, size_t b) {
+        return matches[a].distance < matches[b].distance;
+    });
     Point2fVec pts1;
     Point2fVec pts2;
-    for (const auto& m : matches)
+    pts1.reserve(matches.size());
+    pts2.reserve(matches.size());
+    for (size_t i : order)
     {
-        pts1.push_back(img1Keypoints[m.queryIdx].pt);
-        pts2.push_back(img2Keypoints[m.trainIdx].pt);
+        pts1.push_back(img1Keypoints[matches[i].queryIdx].pt);
+        pts2.push_back(img2Keypoints[matches[i].trainIdx].pt);
     }
+    PROFILE_SCOPE("find_homography");
     cv::Mat inliers;
-    homography = cv::findHomography(pts2, pts1, inliers, cv::RANSAC, ransacVal);
+    homography = findHomography(pts2, pts1, ransacVal, inliers);
     if (homography.empty())
     {
         std::cerr << "Homography estimation failed" << std::endl;
     }
+    if (stats)
+    {
+        stats->matches = static_cast<int>(matches.size());
+        stats->inliers = homography.empty() ? 0 : cv::countNonZero(inliers);
+        stats->iterationsBound = iterationsBound(stats->inliers,
+                stats->matches, m_estimator);
+    }
+}
+
+bool ImageProcessing::RefineHomography(const cv::Mat& img1,
+        const cv::Mat& img2, cv::Mat& homography, float ratio,
+        float ransacVal, float tolerance, int keypointsCount) const
+{
+    Point2fVec corners1;
+    Point2fVec corners2;
+    Point2fVec warpedCorners1;
+    Point2fVec warpedCorners2;
+    computeCorners(img1, corners1);
+    computeCorners(img2, corners2);
+    cv::perspectiveTransform(corners2, warpedCorners2, homography);
+    cv::perspectiveTransform(corners1, warpedCorners1, homography.inv());
+    cv::Rect roi1 = cv::boundingRect(warpedCorners2)
+        & cv::Rect(0, 0, img1.cols, img1.rows);
+    cv::Rect roi2 = cv::boundingRect(warpedCorners1)
+        & cv::Rect(0, 0, img2.cols, img2.rows);
+    if (roi1.empty() || roi2.empty())
+    {
+        return false;
+    }
+    cv::Mat gray1;
+    cv::Mat gray2;
+    ImageFeatures img1Features;
+    ImageFeatures img2Features;
+    MakeGray(img1(roi1), gray1);
+    MakeGray(img2(roi2), gray2);
+    DetectFeatures(gray1, img1Features, keypointsCount);
+    DetectFeatures(gray2, img2Features, keypointsCount);
+    for (auto& kp : img1Features.keypoints)
+    {
+        kp.pt += cv::Point2f((float)roi1.x, (float)roi1.y);
+    }
+    for (auto& kp : img2Features.keypoints)
+    {
+        kp.pt += cv::Point2f((float)roi2.x, (float)roi2.y);
+    }
+    DMatchVec matches;
+    MatchFeatures(img1Features, img2Features, matches, ratio);
+    if (matches.size() < MIN_REFINE_MATCHES)
+    {
+        return false;
+    }
+    Point2fVec pts1;
+    Point2fVec pts2;
+    Point2fVec predicted;
+    for (const auto& m : matches)
+    {
+        pts1.push_back(img1Features.keypoints[m.queryIdx].pt);
+        pts2.push_back(img2Features.keypoints[m.trainIdx].pt);
+    }
+    cv::perspectiveTransform(pts2, predicted, homography);
+    // Keep only the matches the coarse estimate agrees with
+    Point2fVec consistent1;
+    Point2fVec consistent2;
+    for (size_t i = 0; i < pts1.size(); ++i)
+    {
+        if (cv::norm(predicted[i] - pts1[i]) < tolerance)
+        {
+            consistent1.push_back(pts1[i]);
+            consistent2.push_back(pts2[i]);
+        }
+    }
+    if (consistent1.size() < MIN_REFINE_MATCHES)
+    {
+        return false;
+    }
+    cv::Mat inliers;
+    cv::Mat refined = findHomography(consistent2, consistent1, ransacVal,
+            inliers);
+    if (refined.empty())
+    {
+        return false;
+    }
+    refined.convertTo(homography, CV_64F);
+    return true;
+}
+
+cv::Mat ImageProcessing::findHomography(const Point2fVec& src,
+        const Point2fVec& dst, float ransacVal, cv::Mat& inliers) const
+{
+    if (EstimatorType::RANSAC == m_estimator.type)
+    {
+        return cv::findHomography(src, dst, cv::RANSAC, ransacVal, inliers,
+                m_estimator.maxIters, m_estimator.confidence);
+    }
+    cv::UsacParams params;
+    params.threshold = ransacVal;
+    params.confidence = m_estimator.confidence;
+    params.maxIterations = m_estimator.maxIters;
+    params.sampler = cv::SAMPLING_UNIFORM;
+    params.score = cv::SCORE_METHOD_MSAC;
+    params.loMethod = m_estimator.localOptimization
+        ? cv::LOCAL_OPTIM_INNER_AND_ITER_LO : cv::LOCAL_OPTIM_NULL;
+    switch (m_estimator.type)
+    {
+    case EstimatorType::PROSAC:
+        params.sampler = cv::SAMPLING_PROSAC;
+        break;
+    case EstimatorType::MAGSAC:
+        params.score = cv::SCORE_METHOD_MAGSAC;
+        params.loMethod = m_estimator.localOptimization
+            ? cv::LOCAL_OPTIM_SIGMA : cv::LOCAL_OPTIM_NULL;
+        params.final_polisher = cv::MAGSAC;
+        break;
+    default:
+        break;
+    }
+    return cv::findHomography(src, dst, inliers, params);
+}
+
+static void thumbnailGray(const cv::Mat& img, double scale, cv::Mat& res)
+{
+    cv::Mat small;
+    cv::resize(img, small, cv::Size(), scale, scale, cv::INTER_AREA);
+    if (3 == small.channels())
+    {
+        cv::cvtColor(small, res, cv::COLOR_BGR2GRAY);
+        return;
+    }
+    res = small;
+}
+
+/*
+ * Normalised cross-correlation of img1 and img2 warped onto it over their
+ * overlap, on gray thumbnails: close to 1 when the homography (img2 to
+ * img1) lines the images up, around 0 when it does not. 0 without a usable
+ * overlap.
+ */
+double ImageProcessing::OverlapConsistency(const cv::Mat& img1,
+        const cv::Mat& img2, const cv::Mat& homography) const
+{
+    PROFILE_SCOPE("consistency");
+    double area = static_cast<double>(img1.cols) * img1.rows;
+    double scale = std::min(1.0, std::sqrt(CONSISTENCY_MEGAPIX * 1e6 / area));
+    cv::Mat gray1;
+    cv::Mat gray2;
+    thumbnailGray(img1, scale, gray1);
+    thumbnailGray(img2, scale, gray2);
+    cv::Mat scaling = (cv::Mat_<double>(3, 3) <<
+            scale, 0, 0,
+            0, scale, 0,
+            0, 0, 1);
+    cv::Mat forward;
+    homography.convertTo(forward, CV_64F);
+    forward = scaling * forward * scaling.inv();
+    cv::Mat warped;
+    cv::Mat mask;
+    cv::warpPerspective(gray2, warped, forward, gray1.size());
+    cv::warpPerspective(cv::Mat(gray2.size(), CV_8U, cv::Scalar(255)), mask,
+            forward, gray1.size(), cv::INTER_NEAREST);
+    cv::erode(mask, mask, cv::Mat());
+    if (cv::countNonZero(mask) < MIN_CONSISTENCY_PIXELS)
+    {
+        return 0;
+    }
+    cv::Mat values1;
+    cv::Mat values2;
+    gray1.convertTo(values1, CV_32F);
+    warped.convertTo(values2, CV_32F);
+    cv::Scalar mean1;
+    cv::Scalar mean2;
+    cv::Scalar stddev1;
+    cv::Scalar stddev2;
+    cv::meanStdDev(values1, mean1, stddev1, mask);
+    cv::meanStdDev(values2, mean2, stddev2, mask);
+    double norm = stddev1[0] * stddev2[0];
+    if (norm < 1e-6)
+    {
+        return 0;
+    }
+    values1 -= mean1;
+    values2 -= mean2;
+    return cv::mean(values1.mul(values2), mask)[0] / norm;
 }
 
 void ImageProcessing::computeCorners(const cv::Mat& img,
         Point2fVec& corners) const
+{
+    computeCorners(img.size(), corners);
+}
+
+void ImageProcessing::computeCorners(const cv::Size& size,
+        Point2fVec& corners) const
 {
     Point2fVec tmpCorners = {
-        cv::Point2f(0, 0), cv::Point2f((float)(img.cols), 0),
-        cv::Point2f((float)(img.cols), (float)(img.rows)),
-        cv::Point2f(0, (float)(img.rows))
+        cv::Point2f(0, 0), cv::Point2f((float)(size.width), 0),
+        cv::Point2f((float)(size.width), (float)(size.height)),
+        cv::Point2f(0, (float)(size.height))
     };
     corners.insert(corners.end(), tmpCorners.begin(), tmpCorners.end());
 }
 
 void ImageProcessing::TransformCorners(const cv::Mat& img1, const cv::Mat& img2,
         const cv::Mat& homography, Point2fVec& allCorners) const
+{
+    TransformCorners(img1.size(), img2.size(), homography, allCorners);
+}
+
+void ImageProcessing::TransformCorners(const cv::Size& size1,
+        const cv::Size& size2, const cv::Mat& homography,
+        Point2fVec& allCorners) const
 {
     Point2fVec corners1;
     Point2fVec corners2;
     Point2fVec warpedCorners2;
-    computeCorners(img1, corners1);
-    computeCorners(img2, corners2);
+    computeCorners(size1, corners1);
+    computeCorners(size2, corners2);
     cv::perspectiveTransform(corners2, warpedCorners2, homography);
     allCorners.insert(allCorners.end(), warpedCorners2.begin(),
             warpedCorners2.end());
@@ -88,6 +576,42 @@ void ImageProcessing::TransformCorners(const cv::Mat& img1, const cv::Mat& img2,
 void ImageProcessing::WarpImages(const cv::Mat& img1, const cv::Mat& img2,
         const cv::Mat& homography, const Point2fVec& allCorners,
         cv::Mat& res) const
+{
+    cv::Point offset;
+    WarpImages(img1, img2, homography, allCorners, res, offset);
+}
+
+void ImageProcessing::WarpImages(const cv::Mat& img1, const cv::Mat& img2,
+        const cv::Mat& homography, const Point2fVec& allCorners,
+        cv::Mat& res, cv::Point& offset) const
+{
+    PROFILE_SCOPE("warp");
+    cv::Size size;
+    CanvasGeometry(allCorners, offset, size);
+    cv::Mat stitched(size, img1.type(), cv::Scalar::all(0));
+    cv::Mat roi1 = stitched(cv::Rect(offset.x, offset.y, img1.cols, img1.rows));
+    img1.copyTo(roi1);
+    cv::Mat translation = (cv::Mat_<double>(3, 3) <<
+            1, 0, offset.x,
+            0, 1, offset.y,
+            0, 0, 1);
+    cv::Mat homographyOffset;
+    homography.convertTo(homographyOffset, CV_64F);
+    homographyOffset = translation * homographyOffset;
+    if (CV_8UC3 == img2.type())
+    {
+        m_warpKernel.Warp(img2, stitched, homographyOffset);
+    }
+    else
+    {
+        cv::warpPerspective(img2, stitched, homographyOffset, stitched.size(),
+                cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+    }
+    res = stitched;
+}
+
+void ImageProcessing::CanvasGeometry(const Point2fVec& allCorners,
+        cv::Point& offset, cv::Size& size) const
 {
     float minX = FLT_MAX;
     float minY = FLT_MAX;
@@ -102,17 +626,65 @@ void ImageProcessing::WarpImages(const cv::Mat& img1, const cv::Mat& img2,
     }
     int offsetX = (minX < 0) ? - static_cast<int>(std::floor(minX)) : 0;
     int offsetY = (minY < 0) ? - static_cast<int>(std::floor(minY)) : 0;
-    int width = static_cast<int>(std::ceil(maxX - minX));
-    int height = static_cast<int>(std::ceil(maxY - minY));
-    cv::Mat stitched(height, width, img1.type(), cv::Scalar::all(0));
-    cv::Mat roi1 = stitched(cv::Rect(offsetX, offsetY, img1.cols, img1.rows));
-    img1.copyTo(roi1);
-    cv::Mat homographyOffset = homography.clone();
-    homographyOffset.convertTo(homographyOffset, CV_64F);
-    homographyOffset.at<double>(0, 2) += offsetX;
-    homographyOffset.at<double>(1, 2) += offsetY;
-    cv::Mat warpedImg2;
-    cv::warpPerspective(img2, stitched, homographyOffset, stitched.size(),
-            cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
-    stitched.copyTo(res);
+    // Measured from the integer offset so img1 always fits the canvas
+    int width = static_cast<int>(std::ceil(maxX)) + offsetX;
+    int height = static_cast<int>(std::ceil(maxY)) + offsetY;
+    offset = cv::Point(offsetX, offsetY);
+    size = cv::Size(width, height);
+}
+
+void ImageProcessing::MergeFeatures(const cv::Mat& img1,
+        const ImageFeatures& img1Features, const ImageFeatures& img2Features,
+        const cv::Mat& homography, const cv::Point& offset,
+        ImageFeatures& res) const
+{
+    Point2fVec pts2;
+    Point2fVec warpedPts2;
+    std::vector<int> kept2;
+    cv::Point2f shift((float)offset.x, (float)offset.y);
+    res.keypoints.clear();
+    res.keypoints.reserve(img1Features.keypoints.size()
+            + img2Features.keypoints.size());
+    for (const auto& kp : img1Features.keypoints)
+    {
+        res.keypoints.push_back(kp);
+        res.keypoints.back().pt += shift;
+    }
+    for (const auto& kp : img2Features.keypoints)
+    {
+        pts2.push_back(kp.pt);
+    }
+    if (!pts2.empty())
+    {
+        cv::perspectiveTransform(pts2, warpedPts2, homography);
+    }
+    // Drop img2 keypoints covered by img1, duplicates would fail ratio test
+    for (size_t i = 0; i < warpedPts2.size(); ++i)
+    {
+        const cv::Point2f& pt = warpedPts2[i];
+        int x = static_cast<int>(pt.x);
+        int y = static_cast<int>(pt.y);
+        if (x >= 0 && y >= 0 && x < img1.cols && y < img1.rows
+                && img1.at<cv::Vec3b>(y, x) != cv::Vec3b())
+        {
+            continue;
+        }
+        kept2.push_back(static_cast<int>(i));
+        res.keypoints.push_back(img2Features.keypoints[i]);
+        res.keypoints.back().pt = pt + shift;
+    }
+    const cv::Mat& layout = img1Features.descriptors.empty()
+        ? img2Features.descriptors : img1Features.descriptors;
+    res.descriptors.create(static_cast<int>(res.keypoints.size()),
+            layout.cols, layout.type());
+    img1Features.descriptors.copyTo(
+            res.descriptors.rowRange(0, img1Features.descriptors.rows));
+    for (size_t i = 0; i < kept2.size(); ++i)
+    {
+        img2Features.descriptors.row(kept2[i]).copyTo(res.descriptors.row(
+                    img1Features.descriptors.rows + static_cast<int>(i)));
+    }
+    res.storage.reset();
+    res.index.reset();
+    res.scale = std::min(img1Features.scale, img2Features.scale);
 }
@@ -0,0 +1,257 @@
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "image_source.hxx"
+
+// Scale denominators the codec can decode at, largest first
+static const int REDUCTIONS[] = { 8, 4, 2 };
+
+namespace {
+
+/*
+ * Read only mapping of a whole file, unmapped when it goes out of scope.
+ */
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path)
+        : m_data(MAP_FAILED)
+        , m_size(0)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return;
+        }
+        struct stat st;
+        if (0 == fstat(fd, &st) && 0 != st.st_size)
+        {
+            m_size = st.st_size;
+            m_data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+    }
+    ~MappedFile()
+    {
+        if (MAP_FAILED != m_data)
+        {
+            munmap(m_data, m_size);
+        }
+    }
+
+    bool valid() const { return MAP_FAILED != m_data; }
+    const unsigned char* data() const
+    {
+        return static_cast<const unsigned char*>(m_data);
+    }
+    size_t size() const { return m_size; }
+
+private:
+    void* m_data;
+    size_t m_size;
+};
+
+int bigEndian16(const unsigned char* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+int bigEndian32(const unsigned char* p)
+{
+    return static_cast<int>((static_cast<uint32_t>(p[0]) << 24)
+            | (p[1] << 16) | (p[2] << 8) | p[3]);
+}
+
+/*
+ * The header holds the size as stored, the decoder applies the EXIF
+ * orientation. A rotated image comes out transposed, so is its size.
+ */
+cv::Size orientedSize(const cv::Size& stored, const cv::Mat& image)
+{
+    double asStored = std::abs(static_cast<double>(stored.width) * image.rows
+            - static_cast<double>(stored.height) * image.cols);
+    double transposed = std::abs(static_cast<double>(stored.height)
+            * image.rows - static_cast<double>(stored.width) * image.cols);
+    return (transposed < asStored)
+        ? cv::Size(stored.height, stored.width) : stored;
+}
+
+} // namespace
+
+ImageSource::ImageSource(size_t cacheMb)
+    : m_capBytes(cacheMb << 20)
+    , m_bytes(0)
+{
+}
+
+size_t ImageSource::CachedBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bytes;
+}
+
+/*
+ * Image size from the JPEG frame header or the PNG IHDR chunk, without
+ * decoding; false for other formats.
+ */
+bool ImageSource::headerSize(const unsigned char* data, size_t size,
+        cv::Size& res)
+{
+    static const unsigned char PNG_SIGNATURE[] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+    if (size >= 24
+            && 0 == memcmp(data, PNG_SIGNATURE, sizeof(PNG_SIGNATURE)))
+    {
+        res = cv::Size(bigEndian32(data + 16), bigEndian32(data + 20));
+        return true;
+    }
+    if (size < 4 || 0xff != data[0] || 0xd8 != data[1])
+    {
+        return false;
+    }
+    size_t pos = 2;
+    while (pos + 9 <= size)
+    {
+        if (0xff != data[pos])
+        {
+            return false;
+        }
+        unsigned char marker = data[pos + 1];
+        if (0xff == marker)
+        {
+            ++pos;
+            continue;
+        }
+        // SOF0..SOF15 except DHT, JPG and DAC carry the frame size
+        if (marker >= 0xc0 && marker <= 0xcf && 0xc4 != marker
+                && 0xc8 != marker && 0xcc != marker)
+        {
+            res = cv::Size(bigEndian16(data + pos + 7),
+                    bigEndian16(data + pos + 5));
+            return true;
+        }
+        if (0xda == marker || 0xd9 == marker)
+        {
+            return false;
+        }
+        pos += 2 + bigEndian16(data + pos + 2);
+    }
+    return false;
+}
+
+int ImageSource::reduction(const cv::Size& size, double megapix)
+{
+    double area = static_cast<double>(size.width) * size.height;
+    for (int denominator : REDUCTIONS)
+    {
+        if (area / (denominator * denominator) >= megapix * 1e6)
+        {
+            return denominator;
+        }
+    }
+    return 1;
+}
+
+bool ImageSource::lookup(const std::string& key, cv::Mat& image)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(key);
+    if (m_index.end() == it)
+    {
+        return false;
+    }
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    image = it->second->image;
+    return true;
+}
+
+void ImageSource::insert(const std::string& key, const cv::Mat& image)
+{
+    size_t bytes = image.total() * image.elemSize();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (bytes > m_capBytes || 0 != m_index.count(key))
+    {
+        return;
+    }
+    while (m_bytes + bytes > m_capBytes)
+    {
+        const Entry& oldest = m_entries.back();
+        m_bytes -= oldest.image.total() * oldest.image.elemSize();
+        m_index.erase(oldest.key);
+        m_entries.pop_back();
+    }
+    m_entries.push_front({ key, image });
+    m_index[key] = m_entries.begin();
+    m_bytes += bytes;
+}
+
+cv::Mat ImageSource::Read(const std::string& path, double megapix,
+        cv::Size* size)
+{
+    cv::Mat image;
+    std::string fullKey = path + ":1";
+    if (lookup(fullKey, image))
+    {
+        if (nullptr != size)
+        {
+            *size = image.size();
+        }
+        return image;
+    }
+    MappedFile file(path);
+    if (!file.valid())
+    {
+        return image;
+    }
+    int denominator = 1;
+    cv::Size stored;
+    if (megapix > 0 && headerSize(file.data(), file.size(), stored))
+    {
+        denominator = reduction(stored, megapix);
+    }
+    std::string key = path + ":" + std::to_string(denominator);
+    if (1 != denominator && lookup(key, image))
+    {
+        if (nullptr != size)
+        {
+            *size = orientedSize(stored, image);
+        }
+        return image;
+    }
+    int flags = cv::IMREAD_COLOR;
+    switch (denominator)
+    {
+    case 2:
+        flags = cv::IMREAD_REDUCED_COLOR_2;
+        break;
+    case 4:
+        flags = cv::IMREAD_REDUCED_COLOR_4;
+        break;
+    case 8:
+        flags = cv::IMREAD_REDUCED_COLOR_8;
+        break;
+    }
+    // The mapping is only read, imdecode does not keep it
+    cv::Mat buffer(1, static_cast<int>(file.size()), CV_8U,
+            const_cast<unsigned char*>(file.data()));
+    image = cv::imdecode(buffer, flags);
+    if (!image.empty())
+    {
+        insert(key, image);
+    }
+    if (nullptr != size)
+    {
+        *size = (1 == denominator || image.empty())
+            ? image.size() : orientedSize(stored, image);
+    }
+    return image;
+}
@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <mutex>
 #include <string>
 
 #include <opencv2/opencv.hpp>
@@ -6,53 +9,596 @@
 
 #include "image_stitching.hxx"
 #include "image_processing.hxx"
+#include "feature_cache.hxx"
+#include "image_source.hxx"
+#include "async_writer.hxx"
 #include "logging.hxx"
+#include "profiler.hxx"
 
 namespace fs = boost::filesystem;
 
+static const int REFINE_KEYPOINTS_COUNT = 500;
+static const float REFINE_TOLERANCE = 3.0f;
+static const double OVERLAP_MARGIN = 0.1;
+static const double MAX_PARTIAL_AREA = 0.8;
+static const char* STATE_FEATURES_KEY = "project";
+// Budget mode: the reduced rungs of the quality ladder, the top rung is
+// the configured work resolution and keypoints count
+static const QualityLevel BUDGET_LEVELS[] = {
+    { 0.25f, 1000 },
+    { 1.0f, 3000 }
+};
+static const int TOP_LEVEL = sizeof(BUDGET_LEVELS) / sizeof(BUDGET_LEVELS[0]);
+// A registration below any of these is weak and worth a higher level
+static const int MIN_BUDGET_INLIERS = 40;
+static const double MIN_INLIER_RATIO = 0.2;
+static const double MIN_CONSISTENCY = 0.5;
+// Detection cost estimate (ms per megapixel) until one is measured
+static const double DEFAULT_DETECT_MS_PER_MP = 200.0;
+
 Stitcher::Stitcher(float distanceRatio, int keypointsCount, float ransacValue)
     : m_lastStitched(nullptr)
+    , m_prevScale(1.0f)
     , m_distanceRatio(distanceRatio)
     , m_keypointsCount(keypointsCount)
     , m_ransacValue(ransacValue)
+    , m_featureCache(nullptr)
+    , m_imageSource(nullptr)
+    , m_detectorType(DetectorType::SIFT)
+    , m_matcherType(MatcherType::BRUTE_FORCE)
+    , m_writer(nullptr)
+    , m_workMegapix(0)
+    , m_bRefine(false)
+    , m_overlap(0)
+    , m_bComposite(true)
+    , m_featherWidth(0)
+    , m_gridSize(0)
+    , m_bBudget(false)
+    , m_detectMsPerMp(DEFAULT_DETECT_MS_PER_MP)
 {
 }
 
-void Stitcher::stitch(const ImageProcessing& proc, const cv::Mat& img1,
-        const cv::Mat& img2, const cv::Mat& gray1, const cv::Mat& gray2,
-        cv::Mat& result)
+void Stitcher::SetFeatureCache(FeatureCache* cache)
+{
+    m_featureCache = cache;
+}
+
+void Stitcher::SetImageSource(ImageSource* source)
+{
+    m_imageSource = source;
+}
+
+cv::Mat Stitcher::readImage(const std::string& path) const
+{
+    if (nullptr == m_imageSource)
+    {
+        return cv::imread(path);
+    }
+    return m_imageSource->Read(path);
+}
+
+void Stitcher::SetDetectorType(DetectorType detectorType)
+{
+    m_detectorType = detectorType;
+}
+
+void Stitcher::SetMatcherType(MatcherType matcherType)
+{
+    m_matcherType = matcherType;
+}
+
+void Stitcher::SetWriter(AsyncWriter* writer)
+{
+    m_writer = writer;
+}
+
+void Stitcher::SetWorkResolution(float megapix, bool refine)
+{
+    m_workMegapix = megapix;
+    m_bRefine = refine;
+}
+
+float Stitcher::workScale(const cv::Mat& img, float megapix) const
+{
+    double area = static_cast<double>(img.cols) * img.rows;
+    if (megapix <= 0 || area <= megapix * 1e6)
+    {
+        return 1.0f;
+    }
+    return static_cast<float>(std::sqrt(megapix * 1e6 / area));
+}
+
+void Stitcher::SetCompositing(bool composite)
+{
+    m_bComposite = composite;
+}
+
+void Stitcher::SetFeather(int featherWidth)
+{
+    m_featherWidth = featherWidth;
+    m_canvas.SetFeather(featherWidth);
+}
+
+void Stitcher::SetEstimator(const EstimatorParams& estimator)
+{
+    m_estimator = estimator;
+}
+
+void Stitcher::SetGrid(int gridSize)
+{
+    m_gridSize = gridSize;
+}
+
+/*
+ * Budget mode: pairs are registered at the lowest quality level first and
+ * escalated while they are weak and the next level is predicted to fit
+ * before the deadline; once it passed, registration fails immediately.
+ */
+void Stitcher::SetDeadline(double milliseconds)
+{
+    m_bBudget = true;
+    m_deadline = std::chrono::steady_clock::now()
+        + std::chrono::microseconds(static_cast<int64_t>(milliseconds * 1e3));
+}
+
+bool Stitcher::Expired() const
+{
+    return m_bBudget && std::chrono::steady_clock::now() >= m_deadline;
+}
+
+std::vector<PairQuality> Stitcher::Qualities() const
+{
+    std::lock_guard<std::mutex> lock(m_qualityMutex);
+    return m_qualities;
+}
+
+QualityLevel Stitcher::Level(int level) const
+{
+    if (level >= TOP_LEVEL)
+    {
+        return { m_workMegapix, m_keypointsCount };
+    }
+    QualityLevel res = BUDGET_LEVELS[level];
+    if (m_workMegapix > 0)
+    {
+        res.megapix = std::min(res.megapix, m_workMegapix);
+    }
+    res.keypoints = std::min(res.keypoints, m_keypointsCount);
+    return res;
+}
+
+int Stitcher::startLevel() const
+{
+    return m_bBudget ? 0 : TOP_LEVEL;
+}
+
+void Stitcher::record(const PairQuality& quality) const
+{
+    std::lock_guard<std::mutex> lock(m_qualityMutex);
+    m_qualities.push_back(quality);
+}
+
+void Stitcher::SetOverlap(float overlap)
+{
+    m_overlap = overlap;
+}
+
+cv::Mat Stitcher::Motion() const
+{
+    std::lock_guard<std::mutex> lock(m_motionMutex);
+    return m_motion.clone();
+}
+
+void Stitcher::detectionRois(const cv::Size& size, const cv::Mat& motion,
+        RectVec& rois) const
+{
+    rois.clear();
+    if (m_overlap <= 0)
+    {
+        return;
+    }
+    cv::Rect frame(0, 0, size.width, size.height);
+    if (motion.empty())
+    {
+        // No motion seen yet, assume a left to right sequence
+        int strip = static_cast<int>(std::ceil(size.width
+                    * std::min(1.0f, m_overlap + (float)OVERLAP_MARGIN)));
+        rois.push_back(cv::Rect(0, 0, strip, size.height));
+        rois.push_back(cv::Rect(size.width - strip, 0, strip, size.height));
+    }
+    else
+    {
+        // The next image relates to this one as this one to the previous
+        Point2fVec corners = {
+            cv::Point2f(0, 0), cv::Point2f((float)size.width, 0),
+            cv::Point2f((float)size.width, (float)size.height),
+            cv::Point2f(0, (float)size.height)
+        };
+        Point2fVec nextCorners;
+        Point2fVec prevCorners;
+        cv::perspectiveTransform(corners, nextCorners, motion);
+        cv::perspectiveTransform(corners, prevCorners, motion.inv());
+        int marginX = static_cast<int>(size.width * OVERLAP_MARGIN);
+        int marginY = static_cast<int>(size.height * OVERLAP_MARGIN);
+        for (const auto& pts : { nextCorners, prevCorners })
+        {
+            cv::Rect roi = cv::boundingRect(pts);
+            roi = cv::Rect(roi.x - marginX, roi.y - marginY,
+                    roi.width + 2 * marginX, roi.height + 2 * marginY);
+            roi &= frame;
+            if (!roi.empty())
+            {
+                rois.push_back(roi);
+            }
+        }
+    }
+    if (2 == rois.size() && !(rois[0] & rois[1]).empty())
+    {
+        rois = { rois[0] | rois[1] };
+    }
+    double area = 0;
+    for (const auto& roi : rois)
+    {
+        area += roi.area();
+    }
+    if (rois.empty() || area > MAX_PARTIAL_AREA * frame.area())
+    {
+        rois.clear();
+    }
+}
+
+const RigCalibration& Stitcher::Rig() const
+{
+    return m_rig;
+}
+
+bool Stitcher::WriteState(cv::FileStorage& storage,
+        const std::string& dir) const
+{
+    if (m_prevHomography.empty() || m_prevPath.empty())
+    {
+        LOG_ERROR("There is no sequence state to save");
+        return false;
+    }
+    // The last frame features go to a binary sidecar, YAML would be huge
+    if (!FeatureCache(dir).Store(STATE_FEATURES_KEY, m_prevFeatures))
+    {
+        LOG_ERROR("Unable to save the last frame features");
+        return false;
+    }
+    storage << "prev_path" << fs::absolute(m_prevPath).string();
+    storage << "prev_partial" << (int)m_prevFeatures.partial;
+    storage << "prev_homography" << m_prevHomography;
+    storage << "motion" << m_motion;
+    storage << "rig" << "{";
+    m_rig.Write(storage);
+    storage << "}";
+    return true;
+}
+
+bool Stitcher::ReadState(const cv::FileNode& node, const std::string& dir,
+        cv::Mat* result)
+{
+    ImageFeatures features;
+    cv::Mat homography;
+    std::string path = (std::string)node["prev_path"];
+    node["prev_homography"] >> homography;
+    if (nullptr == result || result->empty() || homography.empty())
+    {
+        LOG_ERROR("Project state or mosaic is missing");
+        return false;
+    }
+    if (!FeatureCache(dir).Load(STATE_FEATURES_KEY, features))
+    {
+        LOG_ERROR("Unable to load the last frame features");
+        return false;
+    }
+    cv::Mat prevImage = readImage(path);
+    if (prevImage.empty())
+    {
+        LOG_ERROR("Unable to read the last frame: %s", path.c_str());
+        return false;
+    }
+    features.partial = 0 != (int)node["prev_partial"];
+    {
+        std::lock_guard<std::mutex> lock(m_motionMutex);
+        node["motion"] >> m_motion;
+    }
+    m_rig.Read(node["rig"]);
+    m_prevFeatures = std::move(features);
+    m_prevImage = prevImage;
+    m_prevScale = 1.0f;
+    m_prevPath = path;
+    m_prevHomography = homography;
+    if (m_bComposite)
+    {
+        m_canvas.Reset(*result);
+        *result = m_canvas.View();
+    }
+    m_lastStitched = result;
+    return true;
+}
+
+void Stitcher::detect(const ImageProcessing& proc, const cv::Mat& img,
+        const std::string& path, ImageFeatures& features,
+        const RectVec& rois) const
+{
+    detect(proc, img, path, features, rois, startLevel());
+}
+
+void Stitcher::detect(const ImageProcessing& proc, const cv::Mat& img,
+        const std::string& path, ImageFeatures& features,
+        const RectVec& rois, int level, float imageScale) const
+{
+    QualityLevel quality = Level(level);
+    std::string key;
+    features = ImageFeatures();
+    if (nullptr != m_featureCache && !path.empty())
+    {
+        std::string params = proc.FeatureParams(quality.keypoints)
+            + ":work=" + std::to_string(quality.megapix);
+        if (1.0f != imageScale)
+        {
+            params += ":decode=" + std::to_string(imageScale);
+        }
+        for (const auto& roi : rois)
+        {
+            params += ":roi=" + std::to_string(roi.x) + ","
+                + std::to_string(roi.y) + "," + std::to_string(roi.width)
+                + "," + std::to_string(roi.height);
+        }
+        PROFILE_SCOPE("cache_load");
+        key = m_featureCache->MakeKey(path, params);
+        if (m_featureCache->Load(key, features))
+        {
+            features.partial = !rois.empty();
+            LOG_INFO("Features loaded from cache: %s", path.c_str());
+            return;
+        }
+    }
+    auto start = std::chrono::steady_clock::now();
+    cv::Mat work = img;
+    cv::Mat gray;
+    float scale = workScale(img, quality.megapix);
+    RectVec workRois;
+    if (scale < 1.0f)
+    {
+        PROFILE_SCOPE("resize");
+        cv::resize(img, work, cv::Size(), scale, scale, cv::INTER_AREA);
+    }
+    // Regions and keypoints are in input pixels, img may be decoded reduced
+    scale *= imageScale;
+    for (const auto& roi : rois)
+    {
+        cv::Rect workRoi(cvFloor(roi.x * scale), cvFloor(roi.y * scale),
+                cvCeil(roi.width * scale), cvCeil(roi.height * scale));
+        workRoi &= cv::Rect(0, 0, work.cols, work.rows);
+        if (!workRoi.empty())
+        {
+            workRois.push_back(workRoi);
+        }
+    }
+    proc.MakeGray(work, gray);
+    proc.DetectFeatures(gray, features, quality.keypoints, workRois);
+    if (m_bBudget)
+    {
+        double ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+        std::lock_guard<std::mutex> lock(m_qualityMutex);
+        m_detectMsPerMp = ms / std::max(1e-3, work.total() / 1e6);
+    }
+    if (scale < 1.0f)
+    {
+        for (auto& kp : features.keypoints)
+        {
+            kp.pt *= 1.0 / scale;
+            kp.size /= scale;
+        }
+    }
+    features.scale = scale;
+    if (!key.empty())
+    {
+        PROFILE_SCOPE("cache_store");
+        m_featureCache->Store(key, features);
+    }
+}
+
+bool Stitcher::estimateLevel(const ImageProcessing& proc,
+        const cv::Mat& img1, const cv::Mat& img2,
+        const ImageFeatures& img1Features, const ImageFeatures& img2Features,
+        cv::Mat& homography, EstimationStats& stats, bool refine) const
 {
     DMatchVec matches;
-    KeyPoints img1Kpts;
-    KeyPoints img2Kpts;
+    float scale = std::min(img1Features.scale, img2Features.scale);
+    proc.MatchFeatures(img1Features, img2Features, matches, m_distanceRatio);
+    LOG_INFO("Matches:Size: %d", matches.size());
+    proc.TransformHomography(img1Features.keypoints, img2Features.keypoints,
+            matches, homography, m_ransacValue / scale, &stats);
+    LOG_INFO("Homography:Inliers: %d/%d, iterations_bound: %d",
+            stats.inliers, stats.matches, stats.iterationsBound);
+    if (homography.empty())
+    {
+        return false;
+    }
+    homography.convertTo(homography, CV_64F);
+    if (refine && m_bRefine && scale < 1.0f)
+    {
+        PROFILE_SCOPE("refine");
+        bool refined = proc.RefineHomography(img1, img2, homography,
+                m_distanceRatio, m_ransacValue, REFINE_TOLERANCE / scale,
+                REFINE_KEYPOINTS_COUNT);
+        LOG_INFO("Full resolution refinement: %s",
+                refined ? "applied" : "skipped");
+    }
+    return true;
+}
+
+/*
+ * Whether detecting both images at the next level (plus matching, costed
+ * as the attempt just made) is predicted to finish before the deadline.
+ */
+bool Stitcher::escalate(const cv::Mat& img1, const cv::Mat& img2,
+        int level, double attemptMs) const
+{
+    if (level >= TOP_LEVEL)
+    {
+        return false;
+    }
+    QualityLevel next = Level(level + 1);
+    double megapix = 0;
+    for (const cv::Mat* img : { &img1, &img2 })
+    {
+        float scale = workScale(*img, next.megapix);
+        megapix += img->total() * scale * scale / 1e6;
+    }
+    double msPerMp = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_qualityMutex);
+        msPerMp = m_detectMsPerMp;
+    }
+    auto predicted = std::chrono::microseconds(static_cast<int64_t>(
+                (megapix * msPerMp + attemptMs) * 1e3));
+    return std::chrono::steady_clock::now() + predicted < m_deadline;
+}
+
+// Homography between input pixels taken to the pixels of the images
+static cv::Mat imageHomography(const cv::Mat& homography, float scale1,
+        float scale2)
+{
+    if (1.0f == scale1 && 1.0f == scale2)
+    {
+        return homography;
+    }
+    cv::Mat to1 = cv::Mat::eye(3, 3, CV_64F);
+    to1.at<double>(0, 0) = to1.at<double>(1, 1) = scale1;
+    cv::Mat from2 = cv::Mat::eye(3, 3, CV_64F);
+    from2.at<double>(0, 0) = from2.at<double>(1, 1) = 1.0 / scale2;
+    return to1 * homography * from2;
+}
+
+/*
+ * The features and the homography are in input pixels, imageScale1 and
+ * imageScale2 map them to the images when those were decoded reduced.
+ * Refinement needs the input pixels and is skipped for reduced images.
+ */
+bool Stitcher::estimate(const ImageProcessing& proc, const cv::Mat& img1,
+        const cv::Mat& img2, const ImageFeatures& img1Features,
+        const ImageFeatures& img2Features, cv::Mat& homography,
+        float imageScale1, float imageScale2) const
+{
+    EstimationStats stats;
+    bool refine = 1.0f == imageScale1 && 1.0f == imageScale2;
+    if (!m_bBudget)
+    {
+        return estimateLevel(proc, img1, img2, img1Features, img2Features,
+                homography, stats, refine);
+    }
+    PairQuality quality;
+    if (Expired())
+    {
+        LOG_ERROR("Deadline exceeded, pair not registered");
+        quality.expired = true;
+        record(quality);
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    const ImageFeatures* features1 = &img1Features;
+    const ImageFeatures* features2 = &img2Features;
+    ImageFeatures escalated1;
+    ImageFeatures escalated2;
+    bool registered = false;
+    for (int level = startLevel(); ; ++level)
+    {
+        auto attempt = std::chrono::steady_clock::now();
+        registered = estimateLevel(proc, img1, img2, *features1, *features2,
+                homography, stats, refine);
+        quality.level = level;
+        quality.matches = stats.matches;
+        quality.inliers = stats.inliers;
+        quality.consistency = registered ? proc.OverlapConsistency(img1, img2,
+                imageHomography(homography, imageScale1, imageScale2)) : 0;
+        quality.weak = !registered || stats.inliers < MIN_BUDGET_INLIERS
+            || stats.inliers < MIN_INLIER_RATIO * stats.matches
+            || quality.consistency < MIN_CONSISTENCY;
+        double attemptMs = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - attempt).count();
+        if (!quality.weak || !escalate(img1, img2, level, attemptMs))
+        {
+            break;
+        }
+        LOG_INFO("Weak registration at level %d (inliers %d/%d, "
+                "consistency %.2f), escalating", level, stats.inliers,
+                stats.matches, quality.consistency);
+        detect(proc, img1, "", escalated1, RectVec(), level + 1,
+                imageScale1);
+        detect(proc, img2, "", escalated2, RectVec(), level + 1,
+                imageScale2);
+        features1 = &escalated1;
+        features2 = &escalated2;
+    }
+    quality.ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    if (quality.weak)
+    {
+        LOG_WARN("Pair kept weak registration at level %d",
+                quality.level);
+    }
+    record(quality);
+    return registered;
+}
+
+void Stitcher::stitch(const ImageProcessing& proc, const cv::Mat& img1,
+        const cv::Mat& img2, const ImageFeatures& img1Features,
+        const ImageFeatures& img2Features, cv::Mat& result)
+{
+    PROFILE_SCOPE("stitch");
     cv::Mat homography;
     Point2fVec allCorners;
-    Logging::LogInfo("Image1:Size: %dx%d", img1.cols, img1.rows);
-    Logging::LogInfo("Image2:Size: %dx%d", img2.cols, img2.rows);
-    proc.FindMatches(gray1, gray2, matches, img1Kpts, img2Kpts,
-            m_distanceRatio, m_keypointsCount);
-    Logging::LogInfo("KeyPoints1:Size: %d", img1Kpts.size());
-    Logging::LogInfo("KeyPoints2:Size: %d", img2Kpts.size());
-    Logging::LogInfo("Matches:Size: %d", matches.size());
-    proc.TransformHomography(img1Kpts, img2Kpts, matches,
-            homography, m_ransacValue);
+    LOG_INFO("Image1:Size: %dx%d", img1.cols, img1.rows);
+    LOG_INFO("Image2:Size: %dx%d", img2.cols, img2.rows);
+    LOG_INFO("KeyPoints1:Size: %d", img1Features.keypoints.size());
+    LOG_INFO("KeyPoints2:Size: %d", img2Features.keypoints.size());
+    if (!estimate(proc, img1, img2, img1Features, img2Features, homography))
+    {
+        LOG_ERROR("Unable to stitch images, result is unchanged");
+        return;
+    }
     proc.TransformCorners(img1, img2, homography, allCorners);
     proc.WarpImages(img1, img2, homography, allCorners, result);
-    Logging::LogInfo("Result:Size: %dx%d", result.cols, result.rows);
+    LOG_INFO("Result:Size: %dx%d", result.cols, result.rows);
+}
+
+void Stitcher::stitch(const cv::Mat& img1, const std::string& path1,
+        const cv::Mat& img2, const std::string& path2, cv::Mat& result)
+{
+    ImageProcessing proc(m_detectorType, m_matcherType, m_featherWidth,
+            m_estimator, m_gridSize);
+    ImageFeatures img1Features;
+    ImageFeatures img2Features;
+    detect(proc, img1, path1, img1Features);
+    detect(proc, img2, path2, img2Features);
+    stitch(proc, img1, img2, img1Features, img2Features, result);
 }
 
 void Stitcher::Stitch2Images(cv::Mat* img1, cv::Mat* img2, cv::Mat* result)
 {
     if (nullptr == img1 || nullptr == img2)
     {
-        Logging::LogError("Image file is empty");
+        LOG_ERROR("Image file is empty");
+        return;
     }
-    ImageProcessing proc;
-    cv::Mat gray1;
-    cv::Mat gray2;
-    proc.MakeGray(*img1, gray1);
-    proc.MakeGray(*img2, gray2);
-    stitch(proc, *img1, *img2, gray1, gray2, *result);
+    stitch(*img1, "", *img2, "", *result);
+    m_lastStitched = result;
+}
+
+/*
+ * The sequence calls keep a pointer to the caller's result, the caller
+ * ends the sequence before that result goes away. The next StitchNext
+ * starts a new mosaic, the rig of the ended one stays readable.
+ */
+void Stitcher::EndSequence()
+{
+    m_lastStitched = nullptr;
 }
 
 void Stitcher::StitchToLastResult(cv::Mat* newImg, cv::Mat* result)
@@ -63,16 +609,349 @@ void Stitcher::StitchToLastResult(cv::Mat* newImg, cv::Mat* result)
 void Stitcher::Stitch2Images(const std::string& img1, const std::string& img2,
         cv::Mat* result)
 {
-    cv::Mat srcFile1 = cv::imread(img1);
-    cv::Mat srcFile2 = cv::imread(img2);
-    Stitch2Images(&srcFile1, &srcFile2, result);
+    cv::Mat srcFile1;
+    cv::Mat srcFile2;
+    {
+        PROFILE_SCOPE("decode");
+        srcFile1 = readImage(img1);
+        srcFile2 = readImage(img2);
+    }
+    stitch(srcFile1, img1, srcFile2, img2, *result);
+    m_lastStitched = result;
 }
 
 void Stitcher::StitchToLastResult(const std::string& newImg, cv::Mat* result)
 {
-    cv::Mat img = cv::imread(newImg);
-    StitchToLastResult(&img, result);
-    Logging::LogInfo("Stitch To Last: %s", newImg.c_str());
+    StitchFrame frame;
+    PrepareFrame(newImg, frame);
+    StitchToLastResult(frame, result);
+}
+
+void Stitcher::StitchToLastResult(StitchFrame& frame, cv::Mat* result)
+{
+    if (nullptr == m_lastStitched)
+    {
+        LOG_ERROR("There is no previous result to stitch to");
+        return;
+    }
+    ImageProcessing proc(m_detectorType, m_matcherType, m_featherWidth,
+            m_estimator, m_gridSize);
+    ImageFeatures lastFeatures;
+    detect(proc, *m_lastStitched, "", lastFeatures);
+    if (frame.features.empty())
+    {
+        detect(proc, frame.image, frame.path, frame.features);
+    }
+    stitch(proc, *m_lastStitched, frame.image, lastFeatures, frame.features,
+            *result);
+    m_lastStitched = result;
+    LOG_INFO("Stitch To Last: %s", frame.path.c_str());
+}
+
+void Stitcher::PrepareFrame(const std::string& path, StitchFrame& frame) const
+{
+    PrepareFrame(path, Motion(), frame);
+}
+
+/*
+ * motion is the last chained pair motion the overlap regions are predicted
+ * from. Frames prepared ahead of the chain take it when they are queued,
+ * so their regions (and feature cache keys) do not depend on how far the
+ * chain got by the time they run.
+ */
+void Stitcher::PrepareFrame(const std::string& path, const cv::Mat& motion,
+        StitchFrame& frame) const
+{
+    ImageProcessing proc(m_detectorType, m_matcherType, m_featherWidth,
+            m_estimator, m_gridSize);
+    frame.path = path;
+    {
+        PROFILE_SCOPE("decode");
+        // Without compositing the pixels are never warped, the working
+        // resolution is all registration needs
+        if (!m_bComposite && m_workMegapix > 0 && nullptr != m_imageSource)
+        {
+            frame.image = m_imageSource->Read(path, m_workMegapix,
+                    &frame.size);
+        }
+        else
+        {
+            frame.image = readImage(path);
+            frame.size = frame.image.size();
+        }
+    }
+    if (frame.image.empty())
+    {
+        LOG_ERROR("Unable to read image file: %s", path.c_str());
+        return;
+    }
+    // The codec reduces by a whole denominator, rounded up in pixels; size
+    // is oriented like the image, so its width matches the image columns
+    frame.scale = 1.0f / cvRound(static_cast<double>(frame.size.width)
+            / frame.image.cols);
+    RectVec rois;
+    detectionRois(frame.size, motion, rois);
+    detect(proc, frame.image, path, frame.features, rois, startLevel(),
+            frame.scale);
+    LOG_INFO("KeyPoints:Size: %d (%d regions) %s",
+            frame.features.keypoints.size(), rois.size(), path.c_str());
+}
+
+void Stitcher::PrepareFrame(const ImageView& view, StitchFrame& frame) const
+{
+    ImageProcessing proc(m_detectorType, m_matcherType, m_featherWidth,
+            m_estimator, m_gridSize);
+    cv::Mat image = view.Wrap();
+    frame.path = "";
+    if (image.empty())
+    {
+        LOG_ERROR("Image view is empty");
+        return;
+    }
+    if (1 == view.channels)
+    {
+        cv::cvtColor(image, frame.image, cv::COLOR_GRAY2BGR);
+    }
+    else if (4 == view.channels)
+    {
+        cv::cvtColor(image, frame.image, cv::COLOR_BGRA2BGR);
+    }
+    else
+    {
+        frame.image = image;
+    }
+    // Overlap regions come from the motion of a stateful sequence, views
+    // are independent requests and are detected on the whole image
+    detect(proc, frame.image, "", frame.features);
+    LOG_INFO("KeyPoints:Size: %d", frame.features.keypoints.size());
+}
+
+cv::Mat Stitcher::Stitch(const std::vector<ImageView>& images) const
+{
+    PROFILE_SCOPE("stitch_views");
+    std::vector<StitchFrame> frames(images.size());
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        PrepareFrame(images[i], frames[i]);
+    }
+    return StitchFrames(frames);
+}
+
+cv::Mat Stitcher::StitchFrames(std::vector<StitchFrame>& frames) const
+{
+    StitchFrame mosaic;
+    bool merged = false;
+    for (size_t i = 0; i < frames.size(); ++i)
+    {
+        merged = FoldFrame(mosaic, frames[i], i) || merged;
+    }
+    if (!merged && !mosaic.image.empty())
+    {
+        // A single valid frame may still point to the caller's buffer
+        return mosaic.image.clone();
+    }
+    return mosaic.image;
+}
+
+/*
+ * Registers frame (input index) into mosaic, or starts the mosaic with the
+ * first valid frame. The frame is released either way, so a caller folding
+ * frames as they are prepared only holds the mosaic. True when merged.
+ */
+bool Stitcher::FoldFrame(StitchFrame& mosaic, StitchFrame& frame,
+        size_t index) const
+{
+    StitchFrame current = std::move(frame);
+    frame = StitchFrame();
+    if (current.image.empty())
+    {
+        LOG_ERROR("Image %d skipped, it is empty", index);
+        return false;
+    }
+    if (mosaic.image.empty())
+    {
+        mosaic = std::move(current);
+        return false;
+    }
+    StitchFrame next;
+    if (!StitchPair(mosaic, current, next))
+    {
+        LOG_ERROR("Image %d skipped, unable to register it", index);
+        return false;
+    }
+    mosaic = std::move(next);
+    return true;
+}
+
+bool Stitcher::StitchPair(const StitchFrame& left, const StitchFrame& right,
+        StitchFrame& merged) const
+{
+    PROFILE_SCOPE("stitch_pair");
+    ImageProcessing proc(m_detectorType, m_matcherType, m_featherWidth,
+            m_estimator, m_gridSize);
+    cv::Mat homography;
+    Point2fVec allCorners;
+    cv::Point offset;
+    if (!estimate(proc, left.image, right.image, left.features,
+                right.features, homography))
+    {
+        LOG_ERROR("Unable to register %s to %s", right.path.c_str(),
+                left.path.c_str());
+        return false;
+    }
+    proc.TransformCorners(left.image, right.image, homography, allCorners);
+    proc.WarpImages(left.image, right.image, homography, allCorners,
+            merged.image, offset);
+    proc.MergeFeatures(left.image, left.features, right.features, homography,
+            offset, merged.features);
+    merged.path = left.path + " + " + right.path;
+    LOG_INFO("Merged:Size: %dx%d", merged.image.cols,
+            merged.image.rows);
+    return true;
+}
+
+bool Stitcher::chain(const ImageProcessing& proc, StitchFrame& frame,
+        cv::Mat& result)
+{
+    PROFILE_SCOPE("chain");
+    const cv::Mat& img = frame.image;
+    ImageFeatures& features = frame.features;
+    cv::Mat pairHomography;
+    Point2fVec allCorners;
+    cv::Point offset;
+    LOG_INFO("Image:Size: %dx%d", frame.size.width, frame.size.height);
+    LOG_INFO("KeyPoints:Size: %d", features.keypoints.size());
+    bool registered = estimate(proc, m_prevImage, img, m_prevFeatures,
+            features, pairHomography, m_prevScale, frame.scale);
+    if (!registered && (features.partial || m_prevFeatures.partial))
+    {
+        LOG_WARN("Predicted overlap failed, detecting on full images");
+        detect(proc, m_prevImage, "", m_prevFeatures, RectVec(),
+                startLevel(), m_prevScale);
+        detect(proc, img, "", features, RectVec(), startLevel(),
+                frame.scale);
+        registered = estimate(proc, m_prevImage, img, m_prevFeatures,
+                features, pairHomography, m_prevScale, frame.scale);
+    }
+    if (!registered)
+    {
+        LOG_ERROR("Image skipped, unable to register it to the "
+                "previous one");
+        m_rig.AddView(cv::Mat(), frame.size);
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_motionMutex);
+        m_motion = pairHomography.clone();
+    }
+    cv::Mat homography = m_prevHomography * pairHomography;
+    cv::Size canvasSize;
+    proc.TransformCorners(m_rig.CanvasSize(), frame.size, homography,
+            allCorners);
+    proc.CanvasGeometry(allCorners, offset, canvasSize);
+    cv::Mat translation = (cv::Mat_<double>(3, 3) <<
+            1, 0, offset.x,
+            0, 1, offset.y,
+            0, 0, 1);
+    m_prevHomography = translation * homography;
+    if (m_bComposite)
+    {
+        m_canvas.Resize(offset, canvasSize);
+        m_canvas.Warp(img, m_prevHomography);
+        result = m_canvas.View();
+    }
+    m_rig.Translate(offset);
+    m_rig.AddView(m_prevHomography, frame.size);
+    m_rig.SetCanvasSize(canvasSize);
+    LOG_INFO("Result:Size: %dx%d", canvasSize.width,
+            canvasSize.height);
+    return true;
+}
+
+/*
+ * View i of the rig is input i of the sequence: an input that is skipped,
+ * the first ones included, gets an empty view. False when it was skipped.
+ */
+bool Stitcher::StitchNext(StitchFrame& frame, cv::Mat* result)
+{
+    if (nullptr == result)
+    {
+        LOG_ERROR("No result to stitch into");
+        return false;
+    }
+    if (nullptr == m_lastStitched)
+    {
+        m_rig.Reset();
+        m_prevFeatures = ImageFeatures();
+        m_lastStitched = result;
+    }
+    if (frame.image.empty())
+    {
+        LOG_ERROR("Image file is empty");
+        m_rig.AddView(cv::Mat(), cv::Size());
+        return false;
+    }
+    ImageProcessing proc(m_detectorType, m_matcherType, m_featherWidth,
+            m_estimator, m_gridSize);
+    if (frame.size.empty())
+    {
+        frame.size = frame.image.size();
+    }
+    if (frame.features.empty())
+    {
+        detect(proc, frame.image, frame.path, frame.features, RectVec(),
+                startLevel(), frame.scale);
+    }
+    if (m_prevFeatures.empty())
+    {
+        if (frame.features.empty())
+        {
+            LOG_ERROR("Image skipped, no features to start the mosaic: %s",
+                    frame.path.c_str());
+            m_rig.AddView(cv::Mat(), frame.size);
+            return false;
+        }
+        // The first registered input starts the mosaic
+        *result = frame.image;
+        if (m_bComposite)
+        {
+            m_canvas.Reset(frame.image);
+            *result = m_canvas.View();
+        }
+        m_prevHomography = cv::Mat::eye(3, 3, CV_64F);
+        m_rig.AddView(m_prevHomography, frame.size);
+        m_rig.SetCanvasSize(frame.size);
+    }
+    else if (!chain(proc, frame, *result))
+    {
+        return false;
+    }
+    m_prevFeatures = std::move(frame.features);
+    m_prevImage = frame.image;
+    m_prevScale = frame.scale;
+    m_prevPath = frame.path;
+    m_lastStitched = result;
+    LOG_INFO("Stitch Next: %s", frame.path.c_str());
+    return true;
+}
+
+bool Stitcher::StitchNext(cv::Mat* newImg, cv::Mat* result)
+{
+    if (nullptr == newImg)
+    {
+        LOG_ERROR("Image file is empty");
+        return false;
+    }
+    StitchFrame frame;
+    frame.image = *newImg;
+    return StitchNext(frame, result);
+}
+
+bool Stitcher::StitchNext(const std::string& newImg, cv::Mat* result)
+{
+    StitchFrame frame;
+    PrepareFrame(newImg, frame);
+    return StitchNext(frame, result);
 }
 
 void Stitcher::SaveFile(const std::string& dir, const std::string& file,
@@ -80,13 +959,21 @@ void Stitcher::SaveFile(const std::string& dir, const std::string& file,
 {
     if (nullptr == result)
     {
-        Logging::LogError("Result file is empty");
+        LOG_ERROR("Result file is empty");
         return;
     }
     fs::path outputPath(dir);
     fs::path path = outputPath / file;
     m_lastStitched = result;
-    Logging::LogInfo("Saving result file to: %s", path.string().c_str());
+    LOG_INFO("Saving result file to: %s", path.string().c_str());
+    if (nullptr != m_writer)
+    {
+        // The canvas keeps changing in place while the writer encodes
+        m_writer->Write(path.string(), m_canvas.Shares(*result)
+                ? result->clone() : *result);
+        return;
+    }
+    PROFILE_SCOPE("encode");
     cv::imwrite(path.string(), *(result));
-    Logging::LogInfo("Result file is saved: %s", path.string().c_str());
+    LOG_INFO("Result file is saved: %s", path.string().c_str());
 }
@@ -0,0 +1,20 @@
+#include <opencv2/opencv.hpp>
+
+#include "image_view.hxx"
+
+bool ImageView::empty() const
+{
+    return nullptr == data || width <= 0 || height <= 0
+        || (1 != channels && 3 != channels && 4 != channels);
+}
+
+cv::Mat ImageView::Wrap() const
+{
+    if (empty())
+    {
+        return cv::Mat();
+    }
+    size_t step = (0 == stride) ? cv::Mat::AUTO_STEP : stride;
+    return cv::Mat(height, width, CV_8UC(channels),
+            const_cast<unsigned char*>(data), step);
+}
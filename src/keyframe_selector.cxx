@@ -0,0 +1,145 @@
+#include <algorithm>
+
+#include <opencv2/opencv.hpp>
+
+#include "keyframe_selector.hxx"
+#include "logging.hxx"
+#include "profiler.hxx"
+
+// Tracking resolution (frame width) and corner budget
+static const int TRACK_WIDTH = 640;
+static const int TRACK_CORNERS = 300;
+static const double CORNER_QUALITY = 0.01;
+static const double CORNER_DISTANCE = 12;
+// Fewer surviving tracks than this means tracking is lost
+static const size_t MIN_TRACKS = 24;
+static const float MOTION_RANSAC = 2.0f;
+
+KeyframeSelector::KeyframeSelector(double minOverlap)
+    : m_minOverlap(minOverlap)
+    , m_overlap(1.0)
+    , m_scale(0)
+{
+}
+
+double KeyframeSelector::Overlap() const
+{
+    return m_overlap;
+}
+
+void KeyframeSelector::startKeyframe(const cv::Mat& gray)
+{
+    m_prevGray = gray;
+    m_origins.clear();
+    m_points.clear();
+    addCorners(gray, cv::Mat());
+}
+
+/*
+ * Tops the tracks up with new corners of gray, away from the live tracks.
+ * Their keyframe origin is the inverse of the current motion.
+ */
+void KeyframeSelector::addCorners(const cv::Mat& gray, const cv::Mat& motion)
+{
+    cv::Mat mask(gray.size(), CV_8U, cv::Scalar(255));
+    for (const auto& pt : m_points)
+    {
+        cv::circle(mask, pt, static_cast<int>(CORNER_DISTANCE),
+                cv::Scalar(0), cv::FILLED);
+    }
+    std::vector<cv::Point2f> corners;
+    cv::goodFeaturesToTrack(gray, corners,
+            TRACK_CORNERS - static_cast<int>(m_points.size()),
+            CORNER_QUALITY, CORNER_DISTANCE, mask);
+    if (corners.empty())
+    {
+        return;
+    }
+    std::vector<cv::Point2f> origins = corners;
+    if (!motion.empty())
+    {
+        cv::Mat inverse;
+        cv::invertAffineTransform(motion, inverse);
+        cv::transform(corners, origins, inverse);
+    }
+    m_points.insert(m_points.end(), corners.begin(), corners.end());
+    m_origins.insert(m_origins.end(), origins.begin(), origins.end());
+}
+
+/*
+ * Fraction of a frame of the given size covered by the keyframe, motion
+ * maps keyframe to frame coordinates.
+ */
+double KeyframeSelector::overlap(const cv::Mat& motion,
+        const cv::Size& size) const
+{
+    std::vector<cv::Point2f> frame = {
+        cv::Point2f(0, 0), cv::Point2f((float)size.width, 0),
+        cv::Point2f((float)size.width, (float)size.height),
+        cv::Point2f(0, (float)size.height)
+    };
+    std::vector<cv::Point2f> keyframe;
+    cv::transform(frame, keyframe, motion);
+    std::vector<cv::Point2f> common;
+    float area = cv::intersectConvexConvex(keyframe, frame, common);
+    return std::max(0.0, static_cast<double>(area) / size.area());
+}
+
+bool KeyframeSelector::Push(const cv::Mat& frame)
+{
+    PROFILE_SCOPE("track");
+    if (0 == m_scale)
+    {
+        m_scale = std::min(1.0, static_cast<double>(TRACK_WIDTH) / frame.cols);
+    }
+    cv::Mat small;
+    cv::resize(frame, small, cv::Size(), m_scale, m_scale, cv::INTER_AREA);
+    cv::Mat gray;
+    cv::cvtColor(small, gray, cv::COLOR_BGR2GRAY);
+    if (m_prevGray.empty() || m_points.empty())
+    {
+        startKeyframe(gray);
+        return true;
+    }
+    std::vector<cv::Point2f> points;
+    std::vector<uchar> status;
+    std::vector<float> errors;
+    cv::calcOpticalFlowPyrLK(m_prevGray, gray, m_points, points, status,
+            errors);
+    std::vector<cv::Point2f> origins;
+    m_points.clear();
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        if (status[i])
+        {
+            origins.push_back(m_origins[i]);
+            m_points.push_back(points[i]);
+        }
+    }
+    m_origins.swap(origins);
+    cv::Mat motion;
+    if (m_points.size() >= MIN_TRACKS)
+    {
+        motion = cv::estimateAffinePartial2D(m_origins, m_points,
+                cv::noArray(), cv::RANSAC, MOTION_RANSAC);
+    }
+    if (motion.empty())
+    {
+        LOG_WARN("Tracking lost, starting a new keyframe");
+        startKeyframe(gray);
+        m_overlap = 0;
+        return true;
+    }
+    m_overlap = overlap(motion, gray.size());
+    if (m_overlap < m_minOverlap)
+    {
+        startKeyframe(gray);
+        return true;
+    }
+    if (m_points.size() < static_cast<size_t>(TRACK_CORNERS / 2))
+    {
+        addCorners(gray, motion);
+    }
+    m_prevGray = gray;
+    return false;
+}
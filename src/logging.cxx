@@ -1,102 +1,338 @@
 #include "logging.hxx"
 
-#include <iostream>
+#include <chrono>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
+#include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
-std::string C_RED = "\033[31m";
-std::string C_YEL = "\033[33m";
-std::string C_CYN = "\033[36m";
-std::string C_RST = "\033[0m";
+static const char* C_RED = "\033[31m";
+static const char* C_YEL = "\033[33m";
+static const char* C_CYN = "\033[36m";
+static const char* C_RST = "\033[0m";
+
+// Longer messages are truncated
+static const size_t MESSAGE_SIZE = 1024;
+// Queue slots, a power of two; a full queue makes callers wait
+static const size_t QUEUE_SIZE = 1024;
+// How long the writer sleeps on an empty queue
+static const std::chrono::milliseconds WRITER_PERIOD(5);
 
-bool Logging::m_bDisabled = false;
-std::ostream* Logging::m_os = &std::cout;
+std::atomic<int> Logging::m_level(static_cast<int>(LogType::INFO));
 
-void Logging::Log(LogType type, const char* format, ...)
+namespace {
+
+struct LogRecord
 {
-    if ( m_bDisabled )
+    LogType type;
+    int thread;
+    int64_t timestamp; // ms since epoch
+    char message[MESSAGE_SIZE];
+};
+
+/*
+ * Bounded multi producer queue (Vyukov): a slot is claimed by moving the
+ * tail and published through its sequence number, so producers never take
+ * a lock. The writer thread is the only consumer.
+ */
+class LogWriter
+{
+public:
+    LogWriter();
+    ~LogWriter();
+
+public:
+    void Push(LogType type, const char* format, va_list args);
+    void Flush();
+    void SetOutputStream(std::ostream* os);
+    void SetFormat(LogFormat format);
+
+private:
+    struct Cell
     {
-        return;
+        std::atomic<size_t> sequence;
+        LogRecord record;
+    };
+
+    void run();
+    bool pop(LogRecord& record);
+    void append(const LogRecord& record, std::string& batch) const;
+
+private:
+    std::vector<Cell> m_cells;
+    std::atomic<size_t> m_tail;
+    size_t m_head;
+    std::ostream* m_os;
+    LogFormat m_format;
+    size_t m_written;
+    bool m_bStop;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_flushed;
+    std::thread m_thread;
+};
+
+LogWriter::LogWriter()
+    : m_cells(QUEUE_SIZE)
+    , m_tail(0)
+    , m_head(0)
+    , m_os(&std::cout)
+    , m_format(LogFormat::TEXT)
+    , m_written(0)
+    , m_bStop(false)
+{
+    for (size_t i = 0; i < m_cells.size(); ++i)
+    {
+        m_cells[i].sequence.store(i, std::memory_order_relaxed);
     }
-    va_list args;
-    va_start(args, format);
-    va_end(args);
-    switch (type)
+    m_thread = std::thread(&LogWriter::run, this);
+}
+
+LogWriter::~LogWriter()
+{
     {
-    case LogType::INFO:
-        LogInfo(format, args);
-        break;
-    case LogType::WARN:
-        LogWarn(format, args);
-        break;
-    case LogType::ERROR:
-        LogError(format, args);
-        break;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bStop = true;
     }
+    m_wake.notify_one();
+    m_thread.join();
+}
+
+int threadNumber()
+{
+    static std::atomic<int> threads(0);
+    thread_local int number = threads.fetch_add(1);
+    return number;
 }
 
-void Logging::LogInfo(const char* format, ...)
+void LogWriter::Push(LogType type, const char* format, va_list args)
 {
-    if ( m_bDisabled )
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    Cell* cell = nullptr;
+    while (true)
     {
-        return;
+        cell = &m_cells[pos & (QUEUE_SIZE - 1)];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence)
+            - static_cast<intptr_t>(pos);
+        if ( 0 == diff )
+        {
+            if ( m_tail.compare_exchange_weak(pos, pos + 1,
+                        std::memory_order_relaxed) )
+            {
+                break;
+            }
+        }
+        else if ( diff < 0 )
+        {
+            // Full, wait for the writer to free a slot
+            m_wake.notify_one();
+            std::this_thread::yield();
+            pos = m_tail.load(std::memory_order_relaxed);
+        }
+        else
+        {
+            pos = m_tail.load(std::memory_order_relaxed);
+        }
     }
-    *m_os << C_CYN << " [INFO] > ";
-    va_list args;
-    va_start(args, format);
-    std::vector<char> buffer(1024);
-    vsnprintf(buffer.data(), buffer.size(), format, args);
-    va_end(args);
-    *m_os << buffer.data() << C_RST << std::endl;
+    LogRecord& record = cell->record;
+    record.type = type;
+    record.thread = threadNumber();
+    record.timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    vsnprintf(record.message, MESSAGE_SIZE, format, args);
+    cell->sequence.store(pos + 1, std::memory_order_release);
 }
 
-void Logging::LogWarn(const char* format, ...)
+bool LogWriter::pop(LogRecord& record)
 {
-    if ( m_bDisabled )
+    Cell& cell = m_cells[m_head & (QUEUE_SIZE - 1)];
+    if ( cell.sequence.load(std::memory_order_acquire) != m_head + 1 )
     {
-        return;
+        return false;
     }
-    *m_os << C_YEL << " [WARNING] > ";
-    va_list args;
-    va_start(args, format);
-    std::vector<char> buffer(1024);
-    vsnprintf(buffer.data(), buffer.size(), format, args);
-    va_end(args);
-    *m_os << buffer.data() << C_RST << std::endl;
+    record = cell.record;
+    cell.sequence.store(m_head + QUEUE_SIZE, std::memory_order_release);
+    ++m_head;
+    return true;
 }
 
-void Logging::LogError(const char* format, ...)
+void appendEscaped(const char* text, std::string& out)
 {
-    if ( m_bDisabled )
+    for (const char* c = text; *c; ++c)
     {
+        switch (*c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if ( static_cast<unsigned char>(*c) < 0x20 )
+            {
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", *c);
+                out += code;
+            }
+            else
+            {
+                out += *c;
+            }
+        }
+    }
+}
+
+void LogWriter::append(const LogRecord& record, std::string& batch) const
+{
+    static const char* levels[] = { "info", "warn", "error" };
+    const char* level = levels[static_cast<int>(record.type)];
+    if ( LogFormat::TEXT == m_format )
+    {
+        bool colors = (&std::cout == m_os);
+        static const char* colorOf[] = { C_CYN, C_YEL, C_RED };
+        static const char* tags[] = { " [INFO] > ", " [WARNING] > ",
+            " [ERROR] > " };
+        if ( colors )
+        {
+            batch += colorOf[static_cast<int>(record.type)];
+        }
+        batch += tags[static_cast<int>(record.type)];
+        batch += record.message;
+        if ( colors )
+        {
+            batch += C_RST;
+        }
+        batch += '\n';
         return;
     }
-    *m_os << C_RED << " [ERROR] > ";
+    char head[96];
+    if ( LogFormat::JSON == m_format )
+    {
+        snprintf(head, sizeof(head),
+                "{\"ts\":%lld,\"level\":\"%s\",\"thread\":%d,\"msg\":\"",
+                static_cast<long long>(record.timestamp), level,
+                record.thread);
+        batch += head;
+        appendEscaped(record.message, batch);
+        batch += "\"}\n";
+        return;
+    }
+    snprintf(head, sizeof(head), "ts=%lld level=%s thread=%d msg=\"",
+            static_cast<long long>(record.timestamp), level, record.thread);
+    batch += head;
+    appendEscaped(record.message, batch);
+    batch += "\"\n";
+}
+
+void LogWriter::run()
+{
+    LogRecord record;
+    std::string batch;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        size_t count = 0;
+        batch.clear();
+        while (pop(record))
+        {
+            append(record, batch);
+            ++count;
+        }
+        if ( 0 != count )
+        {
+            m_os->write(batch.data(), batch.size());
+            m_os->flush();
+            m_written += count;
+            m_flushed.notify_all();
+            continue;
+        }
+        // Producers still writing claimed slots are published shortly
+        if ( m_bStop && m_head == m_tail.load(std::memory_order_acquire) )
+        {
+            break;
+        }
+        m_wake.wait_for(lock, WRITER_PERIOD);
+    }
+}
+
+void LogWriter::Flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    size_t target = m_tail.load(std::memory_order_acquire);
+    m_wake.notify_one();
+    m_flushed.wait(lock, [this, target]() { return m_written >= target; });
+}
+
+void LogWriter::SetOutputStream(std::ostream* os)
+{
+    Flush();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_os = os;
+}
+
+void LogWriter::SetFormat(LogFormat format)
+{
+    Flush();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_format = format;
+}
+
+LogWriter& writer()
+{
+    static LogWriter instance;
+    return instance;
+}
+
+} // namespace
+
+void Logging::write(LogType type, const char* format, ...)
+{
     va_list args;
     va_start(args, format);
-    std::vector<char> buffer(1024);
-    vsnprintf(buffer.data(), buffer.size(), format, args);
+    writer().Push(type, format, args);
     va_end(args);
-    *m_os << buffer.data() << C_RST << std::endl;
 }
 
 void Logging::SetOutputStream(std::ostream* os)
 {
-    Logging::m_os = os;
-    C_RED = "";
-    C_YEL = "";
-    C_CYN = "";
-    C_RST = "";
+    writer().SetOutputStream(os);
 }
 
 void Logging::UnsetOutputStream()
 {
-    Logging::m_os = &std::cout;
+    writer().SetOutputStream(&std::cout);
+}
+
+void Logging::SetLevel(LogType type)
+{
+    m_level.store(static_cast<int>(type), std::memory_order_relaxed);
+}
+
+void Logging::SetFormat(LogFormat format)
+{
+    writer().SetFormat(format);
 }
 
 void Logging::DisableLogging()
 {
-    Logging::m_bDisabled = true;
+    m_level.store(static_cast<int>(LogType::ERROR) + 1,
+            std::memory_order_relaxed);
+}
+
+void Logging::Flush()
+{
+    writer().Flush();
 }
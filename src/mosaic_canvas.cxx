@@ -0,0 +1,126 @@
+#include <opencv2/opencv.hpp>
+
+#include "mosaic_canvas.hxx"
+#include "profiler.hxx"
+
+// Spare room added on a growing side, as a fraction of the mosaic size
+static const double CANVAS_HEADROOM = 0.5;
+
+void MosaicCanvas::Reset(const cv::Mat& image)
+{
+    int padX = cvCeil(image.cols * CANVAS_HEADROOM);
+    int padY = cvCeil(image.rows * CANVAS_HEADROOM);
+    m_buffer = cv::Mat(image.rows + 2 * padY, image.cols + 2 * padX,
+            image.type(), cv::Scalar::all(0));
+    m_view = cv::Rect(padX, padY, image.cols, image.rows);
+    image.copyTo(m_buffer(m_view));
+}
+
+/*
+ * The mosaic origin moves by offset (the old mosaic lands at offset in
+ * the new one) and the mosaic becomes size large.
+ */
+void MosaicCanvas::Resize(const cv::Point& offset, const cv::Size& size)
+{
+    cv::Rect view(m_view.x - offset.x, m_view.y - offset.y, size.width,
+            size.height);
+    cv::Rect bounds(0, 0, m_buffer.cols, m_buffer.rows);
+    if ((view & bounds) == view)
+    {
+        // Never written outside the old view, the exposed part is zero
+        m_view = view;
+        return;
+    }
+    reallocate(view);
+}
+
+void MosaicCanvas::reallocate(const cv::Rect& view)
+{
+    PROFILE_SCOPE("canvas_grow");
+    cv::Rect bounds(0, 0, m_buffer.cols, m_buffer.rows);
+    cv::Rect grown = bounds | view;
+    int padX = cvCeil(view.width * CANVAS_HEADROOM);
+    int padY = cvCeil(view.height * CANVAS_HEADROOM);
+    if (view.x < 0)
+    {
+        grown.x -= padX;
+        grown.width += padX;
+    }
+    if (view.br().x > bounds.width)
+    {
+        grown.width += padX;
+    }
+    if (view.y < 0)
+    {
+        grown.y -= padY;
+        grown.height += padY;
+    }
+    if (view.br().y > bounds.height)
+    {
+        grown.height += padY;
+    }
+    cv::Mat buffer(grown.size(), m_buffer.type(), cv::Scalar::all(0));
+    cv::Point shift = -grown.tl();
+    m_buffer(m_view).copyTo(buffer(m_view + shift));
+    m_buffer = buffer;
+    m_view = view + shift;
+}
+
+/*
+ * Warps image into the mosaic, homography maps image to mosaic (view)
+ * coordinates. Only the bounding box of the warped image is processed.
+ */
+void MosaicCanvas::Warp(const cv::Mat& image, const cv::Mat& homography)
+{
+    PROFILE_SCOPE("warp");
+    std::vector<cv::Point2f> corners = {
+        cv::Point2f(0, 0), cv::Point2f((float)image.cols, 0),
+        cv::Point2f((float)image.cols, (float)image.rows),
+        cv::Point2f(0, (float)image.rows)
+    };
+    std::vector<cv::Point2f> warped;
+    cv::perspectiveTransform(corners, warped, homography);
+    cv::Rect area = cv::boundingRect(warped)
+        & cv::Rect(0, 0, m_view.width, m_view.height);
+    if (area.empty())
+    {
+        return;
+    }
+    cv::Mat translation = (cv::Mat_<double>(3, 3) <<
+            1, 0, -area.x,
+            0, 1, -area.y,
+            0, 0, 1);
+    cv::Mat dst = m_buffer(m_view)(area);
+    if (CV_8UC3 == image.type())
+    {
+        m_warpKernel.Warp(image, dst, translation * homography);
+        return;
+    }
+    cv::warpPerspective(image, dst, translation * homography, dst.size(),
+            cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+}
+
+cv::Mat MosaicCanvas::View() const
+{
+    if (m_buffer.empty())
+    {
+        return cv::Mat();
+    }
+    return m_buffer(m_view);
+}
+
+bool MosaicCanvas::Shares(const cv::Mat& image) const
+{
+    if (m_buffer.empty() || image.empty())
+    {
+        return false;
+    }
+    const uchar* begin = m_buffer.ptr();
+    const uchar* end = begin + m_buffer.step * m_buffer.rows;
+    return image.data >= begin && image.data < end;
+}
+
+void MosaicCanvas::SetFeather(int featherWidth)
+{
+    m_warpKernel.SetFeatherWidth(featherWidth);
+}
@@ -0,0 +1,387 @@
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <set>
+
+#include <opencv2/opencv.hpp>
+
+#include "overlap_graph.hxx"
+#include "image_processing.hxx"
+#include "image_source.hxx"
+#include "thread_pool.hxx"
+#include "logging.hxx"
+#include "profiler.hxx"
+
+static const double THUMBNAIL_MEGAPIX = 0.15;
+static const int THUMBNAIL_KEYPOINTS = 300;
+static const int VOCABULARY_SIZE = 128;
+static const int VOCABULARY_TRAIN_DESCRIPTORS = 50000;
+static const int VOCABULARY_ITERATIONS = 10;
+static const float VERIFY_RATIO = 0.75f;
+static const float VERIFY_RANSAC = 3.0f;
+static const int MIN_OVERLAP_INLIERS = 15;
+
+OverlapGraph::OverlapGraph(ThreadPool& pool, ImageSource& source,
+        int candidates)
+    : m_pool(pool)
+    , m_source(source)
+    , m_candidates(candidates)
+{
+}
+
+bool OverlapGraph::describe(const std::string& path,
+        ImageFeatures& features) const
+{
+    cv::Mat img;
+    {
+        PROFILE_SCOPE("decode");
+        img = m_source.Read(path, THUMBNAIL_MEGAPIX);
+    }
+    if (img.empty())
+    {
+        return false;
+    }
+    double area = static_cast<double>(img.cols) * img.rows;
+    double scale = std::min(1.0, std::sqrt(THUMBNAIL_MEGAPIX * 1e6 / area));
+    cv::Mat thumbnail;
+    cv::resize(img, thumbnail, cv::Size(), scale, scale, cv::INTER_AREA);
+    ImageProcessing proc(DetectorType::SIFT);
+    cv::Mat gray;
+    proc.MakeGray(thumbnail, gray);
+    proc.DetectFeatures(gray, features, THUMBNAIL_KEYPOINTS);
+    // Built here, the concurrent verifications then only read it
+    if (!features.empty())
+    {
+        proc.BuildIndex(features);
+    }
+    return true;
+}
+
+/*
+ * One L2 normalised tf-idf row per image, so the dot product of two rows is
+ * their cosine similarity. The vocabulary is k-means over a sample of the
+ * descriptors of the whole set.
+ */
+void OverlapGraph::signatures(const std::vector<ImageFeatures>& features,
+        cv::Mat& res) const
+{
+    std::vector<cv::Mat> all;
+    int total = 0;
+    for (const auto& f : features)
+    {
+        if (!f.descriptors.empty())
+        {
+            all.push_back(f.descriptors);
+            total += f.descriptors.rows;
+        }
+    }
+    res = cv::Mat::zeros(static_cast<int>(features.size()), VOCABULARY_SIZE,
+            CV_32F);
+    if (total < VOCABULARY_SIZE)
+    {
+        return;
+    }
+    cv::Mat descriptors;
+    cv::vconcat(all, descriptors);
+    cv::Mat sample;
+    int step = std::max(1, total / VOCABULARY_TRAIN_DESCRIPTORS);
+    for (int row = 0; row < descriptors.rows; row += step)
+    {
+        sample.push_back(descriptors.row(row));
+    }
+    cv::Mat labels;
+    cv::Mat vocabulary;
+    cv::kmeans(sample, VOCABULARY_SIZE, labels,
+            cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS,
+                VOCABULARY_ITERATIONS, 1e-3), 1, cv::KMEANS_PP_CENTERS,
+            vocabulary);
+    cv::BFMatcher words(cv::NORM_L2);
+    std::vector<int> documents(VOCABULARY_SIZE, 0);
+    for (size_t i = 0; i < features.size(); ++i)
+    {
+        if (features[i].descriptors.empty())
+        {
+            continue;
+        }
+        DMatchVec nearest;
+        words.match(features[i].descriptors, vocabulary, nearest);
+        float* row = res.ptr<float>(static_cast<int>(i));
+        for (const auto& m : nearest)
+        {
+            row[m.trainIdx] += 1.0f;
+        }
+        for (int w = 0; w < VOCABULARY_SIZE; ++w)
+        {
+            documents[w] += (row[w] > 0) ? 1 : 0;
+        }
+    }
+    for (int w = 0; w < VOCABULARY_SIZE; ++w)
+    {
+        float idf = static_cast<float>(std::log((features.size() + 1.0)
+                    / (documents[w] + 1.0)));
+        cv::Mat column = res.col(w);
+        column *= idf;
+    }
+    for (int i = 0; i < res.rows; ++i)
+    {
+        cv::Mat row = res.row(i);
+        cv::normalize(row, row);
+    }
+}
+
+int OverlapGraph::verify(const ImageFeatures& features1,
+        const ImageFeatures& features2) const
+{
+    if (features1.empty() || features2.empty())
+    {
+        return 0;
+    }
+    ImageProcessing proc(DetectorType::SIFT);
+    DMatchVec matches;
+    proc.MatchFeatures(features1, features2, matches, VERIFY_RATIO);
+    if (matches.size() < static_cast<size_t>(MIN_OVERLAP_INLIERS))
+    {
+        return 0;
+    }
+    cv::Mat homography;
+    EstimationStats stats;
+    proc.TransformHomography(features1.keypoints, features2.keypoints,
+            matches, homography, VERIFY_RANSAC, &stats);
+    return homography.empty() ? 0 : stats.inliers;
+}
+
+bool OverlapGraph::Build(const std::vector<std::string>& files)
+{
+    PROFILE_SCOPE("overlap_graph");
+    std::vector<ImageFeatures> features(files.size());
+    std::vector<std::future<bool>> described;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        described.push_back(m_pool.Submit([this, &files, &features, i]() {
+            return describe(files[i], features[i]);
+        }));
+    }
+    bool ok = true;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        if (!described[i].get())
+        {
+            LOG_ERROR("Unable to read %s", files[i].c_str());
+            ok = false;
+        }
+    }
+    if (!ok)
+    {
+        return false;
+    }
+    cv::Mat signature;
+    signatures(features, signature);
+    cv::Mat similarity = signature * signature.t();
+    // Candidate pairs, each unordered pair once
+    std::set<std::pair<size_t, size_t>> pairs;
+    for (int i = 0; i < similarity.rows; ++i)
+    {
+        std::vector<std::pair<float, int>> ranked;
+        for (int j = 0; j < similarity.cols; ++j)
+        {
+            if (i != j)
+            {
+                ranked.emplace_back(similarity.at<float>(i, j), j);
+            }
+        }
+        size_t top = std::min(ranked.size(),
+                static_cast<size_t>(m_candidates));
+        std::partial_sort(ranked.begin(), ranked.begin() + top, ranked.end(),
+                std::greater<std::pair<float, int>>());
+        for (size_t k = 0; k < top; ++k)
+        {
+            size_t j = static_cast<size_t>(ranked[k].second);
+            pairs.emplace(std::min<size_t>(i, j), std::max<size_t>(i, j));
+        }
+    }
+    std::vector<std::pair<size_t, size_t>> candidates(pairs.begin(),
+            pairs.end());
+    std::vector<std::future<int>> verified;
+    for (const auto& pair : candidates)
+    {
+        verified.push_back(m_pool.Submit([this, &features, pair]() {
+            return verify(features[pair.first], features[pair.second]);
+        }));
+    }
+    m_edges.assign(files.size(), std::vector<Edge>());
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        int inliers = verified[i].get();
+        if (inliers < MIN_OVERLAP_INLIERS)
+        {
+            continue;
+        }
+        m_edges[candidates[i].first].push_back(
+                { candidates[i].second, inliers });
+        m_edges[candidates[i].second].push_back(
+                { candidates[i].first, inliers });
+    }
+    LOG_INFO("Overlap graph: %d images, %d candidate pairs, "
+            "%d overlaps", files.size(), candidates.size(), Edges());
+    return true;
+}
+
+size_t OverlapGraph::Edges() const
+{
+    size_t edges = 0;
+    for (const auto& adjacent : m_edges)
+    {
+        edges += adjacent.size();
+    }
+    return edges / 2;
+}
+
+/*
+ * Prim's algorithm on the inlier counts, one tree per connected component.
+ * parents[i] is i for a root.
+ */
+void OverlapGraph::spanningTree(std::vector<size_t>& parents) const
+{
+    size_t count = m_edges.size();
+    parents.assign(count, count);
+    std::vector<bool> inTree(count, false);
+    std::vector<int> best(count, -1);
+    for (size_t root = 0; root < count; ++root)
+    {
+        if (inTree[root])
+        {
+            continue;
+        }
+        parents[root] = root;
+        best[root] = 0;
+        while (true)
+        {
+            size_t next = count;
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (!inTree[i] && best[i] >= 0
+                        && (count == next || best[i] > best[next]))
+                {
+                    next = i;
+                }
+            }
+            if (count == next)
+            {
+                break;
+            }
+            inTree[next] = true;
+            for (const auto& edge : m_edges[next])
+            {
+                if (!inTree[edge.to] && edge.inliers > best[edge.to])
+                {
+                    best[edge.to] = edge.inliers;
+                    parents[edge.to] = next;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Depth first walk of each spanning tree, re-rooted at one end of its
+ * longest path and visiting the deepest subtree last, so a path shaped set
+ * (a strip, a video) comes out as the path. Every image comes after its
+ * tree parent, which is its predecessor except after a branch ends.
+ * Components follow each other largest first.
+ */
+std::vector<size_t> OverlapGraph::Order() const
+{
+    size_t count = m_edges.size();
+    std::vector<size_t> parents;
+    spanningTree(parents);
+    std::vector<std::vector<size_t>> tree(count);
+    std::vector<size_t> roots;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (parents[i] == i)
+        {
+            roots.push_back(i);
+            continue;
+        }
+        tree[i].push_back(parents[i]);
+        tree[parents[i]].push_back(i);
+    }
+    // Hop distances from a node within its tree, in visiting order
+    auto walk = [&tree, count](size_t from, std::vector<size_t>& visited,
+            std::vector<size_t>& depth) {
+        visited.assign(1, from);
+        depth.assign(count, count);
+        depth[from] = 0;
+        for (size_t k = 0; k < visited.size(); ++k)
+        {
+            for (size_t next : tree[visited[k]])
+            {
+                if (count == depth[next])
+                {
+                    depth[next] = depth[visited[k]] + 1;
+                    visited.push_back(next);
+                }
+            }
+        }
+    };
+    std::vector<std::vector<size_t>> components;
+    for (size_t root : roots)
+    {
+        std::vector<size_t> visited;
+        std::vector<size_t> depth;
+        walk(root, visited, depth);
+        size_t end = visited.back();
+        walk(end, visited, depth);
+        // Height of every subtree when hanging from end
+        std::vector<size_t> height(count, 0);
+        for (size_t k = visited.size(); k-- > 0;)
+        {
+            size_t node = visited[k];
+            for (size_t next : tree[node])
+            {
+                if (depth[next] == depth[node] + 1)
+                {
+                    height[node] = std::max(height[node], height[next] + 1);
+                }
+            }
+        }
+        std::vector<size_t> order;
+        std::vector<size_t> stack(1, end);
+        while (!stack.empty())
+        {
+            size_t node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            std::vector<size_t> children;
+            for (size_t next : tree[node])
+            {
+                if (depth[next] == depth[node] + 1)
+                {
+                    children.push_back(next);
+                }
+            }
+            // Deepest child pushed first, so it is visited last
+            std::sort(children.begin(), children.end(),
+                    [&height](size_t a, size_t b) {
+                return height[a] > height[b];
+            });
+            stack.insert(stack.end(), children.begin(), children.end());
+        }
+        components.push_back(order);
+    }
+    std::stable_sort(components.begin(), components.end(),
+            [](const std::vector<size_t>& a, const std::vector<size_t>& b) {
+        return a.size() > b.size();
+    });
+    if (components.size() > 1)
+    {
+        LOG_WARN("Images form %d unconnected groups",
+                components.size());
+    }
+    std::vector<size_t> order;
+    for (const auto& component : components)
+    {
+        order.insert(order.end(), component.begin(), component.end());
+    }
+    return order;
+}
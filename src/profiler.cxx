@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "profiler.hxx"
+#include "logging.hxx"
+
+namespace {
+
+struct TraceEvent
+{
+    const char* name;
+    size_t threadId;
+    int64_t startUs;
+    int64_t durationUs;
+    long rssKb;
+    size_t allocations;
+    size_t allocatedBytes;
+};
+
+std::atomic<bool> g_enabled(false);
+std::atomic<bool> g_countAllocations(false);
+std::mutex g_eventsMutex;
+std::vector<TraceEvent> g_events;
+std::map<std::thread::id, size_t> g_threadIds;
+const std::chrono::steady_clock::time_point g_origin =
+    std::chrono::steady_clock::now();
+
+std::atomic<size_t> g_totalAllocations(0);
+std::atomic<size_t> g_totalAllocatedBytes(0);
+thread_local size_t t_allocations = 0;
+thread_local size_t t_allocatedBytes = 0;
+
+} // namespace
+
+void Profiler::Enable()
+{
+    g_enabled = true;
+    g_countAllocations = true;
+}
+
+/*
+ * Allocation totals without the timing events, for the benchmark.
+ */
+void Profiler::EnableAllocationCounts()
+{
+    g_countAllocations = true;
+}
+
+bool Profiler::IsEnabled()
+{
+    return g_enabled.load(std::memory_order_relaxed);
+}
+
+int64_t Profiler::NowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - g_origin).count();
+}
+
+long Profiler::CurrentRssKb()
+{
+    long pages = 0;
+    long resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (nullptr == statm)
+    {
+        return 0;
+    }
+    if (2 != fscanf(statm, "%ld %ld", &pages, &resident))
+    {
+        resident = 0;
+    }
+    fclose(statm);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+long Profiler::PeakRssKb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+size_t Profiler::ThreadAllocations()
+{
+    return t_allocations;
+}
+
+size_t Profiler::ThreadAllocatedBytes()
+{
+    return t_allocatedBytes;
+}
+
+void Profiler::CountAllocation(size_t size)
+{
+    if (!g_countAllocations.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    ++t_allocations;
+    t_allocatedBytes += size;
+    g_totalAllocations.fetch_add(1, std::memory_order_relaxed);
+    g_totalAllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+size_t Profiler::TotalAllocations()
+{
+    return g_totalAllocations.load(std::memory_order_relaxed);
+}
+
+size_t Profiler::TotalAllocatedBytes()
+{
+    return g_totalAllocatedBytes.load(std::memory_order_relaxed);
+}
+
+void Profiler::Record(const char* name, int64_t startUs, int64_t durationUs,
+        size_t allocations, size_t allocatedBytes)
+{
+    long rssKb = CurrentRssKb();
+    std::lock_guard<std::mutex> lock(g_eventsMutex);
+    auto tid = g_threadIds.emplace(std::this_thread::get_id(),
+            g_threadIds.size()).first->second;
+    g_events.push_back({ name, tid, startUs, durationUs, rssKb, allocations,
+            allocatedBytes });
+}
+
+bool Profiler::WriteTrace(const std::string& path)
+{
+    std::ofstream os(path);
+    if (!os.is_open())
+    {
+        LOG_ERROR("Unable to write trace file: %s", path.c_str());
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(g_eventsMutex);
+    os << "{\"traceEvents\":[";
+    for (size_t i = 0; i < g_events.size(); ++i)
+    {
+        const TraceEvent& e = g_events[i];
+        os << (0 == i ? "" : ",") << "\n{\"name\":\"" << e.name
+            << "\",\"ph\":\"X\",\"pid\":" << getpid()
+            << ",\"tid\":" << e.threadId
+            << ",\"ts\":" << e.startUs << ",\"dur\":" << e.durationUs
+            << ",\"args\":{\"rss_kb\":" << e.rssKb
+            << ",\"allocations\":" << e.allocations
+            << ",\"allocated_bytes\":" << e.allocatedBytes << "}}";
+    }
+    os << "\n],\"otherData\":{\"peak_rss_kb\":" << PeakRssKb()
+        << ",\"total_allocations\":" << TotalAllocations()
+        << ",\"total_allocated_bytes\":" << TotalAllocatedBytes() << "}}\n";
+    LOG_INFO("Trace file is saved: %s", path.c_str());
+    return static_cast<bool>(os);
+}
+
+void Profiler::LogSummary()
+{
+    struct Stage
+    {
+        size_t count = 0;
+        int64_t totalUs = 0;
+        int64_t maxUs = 0;
+    };
+    std::map<std::string, Stage> stages;
+    {
+        std::lock_guard<std::mutex> lock(g_eventsMutex);
+        for (const auto& e : g_events)
+        {
+            Stage& stage = stages[e.name];
+            ++stage.count;
+            stage.totalUs += e.durationUs;
+            stage.maxUs = std::max(stage.maxUs, e.durationUs);
+        }
+    }
+    for (const auto& stage : stages)
+    {
+        LOG_INFO("Stage %s: %zu calls, %.3f s total, %.3f ms max",
+                stage.first.c_str(), stage.second.count,
+                stage.second.totalUs / 1e6, stage.second.maxUs / 1e3);
+    }
+    LOG_INFO("Peak RSS: %ld KB", PeakRssKb());
+}
+
+ScopedTimer::ScopedTimer(const char* name)
+    : m_name(nullptr)
+    , m_startUs(0)
+    , m_startAllocations(0)
+    , m_startAllocatedBytes(0)
+{
+    if (!Profiler::IsEnabled())
+    {
+        return;
+    }
+    m_name = name;
+    m_startAllocations = Profiler::ThreadAllocations();
+    m_startAllocatedBytes = Profiler::ThreadAllocatedBytes();
+    m_startUs = Profiler::NowUs();
+}
+
+ScopedTimer::~ScopedTimer()
+{
+    if (nullptr == m_name)
+    {
+        return;
+    }
+    Profiler::Record(m_name, m_startUs, Profiler::NowUs() - m_startUs,
+            Profiler::ThreadAllocations() - m_startAllocations,
+            Profiler::ThreadAllocatedBytes() - m_startAllocatedBytes);
+}
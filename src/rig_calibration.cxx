@@ -0,0 +1,203 @@
+#include <opencv2/opencv.hpp>
+
+#include "rig_calibration.hxx"
+#include "logging.hxx"
+
+void RigCalibration::Reset()
+{
+    m_canvasSize = cv::Size();
+    m_views.clear();
+}
+
+void RigCalibration::AddView(const cv::Mat& homography, const cv::Size& size)
+{
+    View view;
+    if (!homography.empty())
+    {
+        homography.convertTo(view.homography, CV_64F);
+    }
+    view.size = size;
+    m_views.push_back(view);
+}
+
+void RigCalibration::Translate(const cv::Point& offset)
+{
+    if (0 == offset.x && 0 == offset.y)
+    {
+        return;
+    }
+    cv::Mat translation = (cv::Mat_<double>(3, 3) <<
+            1, 0, offset.x,
+            0, 1, offset.y,
+            0, 0, 1);
+    for (auto& view : m_views)
+    {
+        if (!view.homography.empty())
+        {
+            view.homography = translation * view.homography;
+        }
+    }
+}
+
+void RigCalibration::SetCanvasSize(const cv::Size& size)
+{
+    m_canvasSize = size;
+}
+
+size_t RigCalibration::ViewsCount() const
+{
+    return m_views.size();
+}
+
+const cv::Size& RigCalibration::CanvasSize() const
+{
+    return m_canvasSize;
+}
+
+const cv::Mat& RigCalibration::ViewHomography(size_t index) const
+{
+    return m_views[index].homography;
+}
+
+const cv::Size& RigCalibration::ViewSize(size_t index) const
+{
+    return m_views[index].size;
+}
+
+void RigCalibration::Write(cv::FileStorage& fs) const
+{
+    fs << "canvas_width" << m_canvasSize.width;
+    fs << "canvas_height" << m_canvasSize.height;
+    fs << "views" << "[";
+    for (const auto& view : m_views)
+    {
+        fs << "{";
+        fs << "width" << view.size.width;
+        fs << "height" << view.size.height;
+        fs << "homography" << view.homography;
+        fs << "}";
+    }
+    fs << "]";
+}
+
+void RigCalibration::Read(const cv::FileNode& node)
+{
+    Reset();
+    m_canvasSize.width = (int)node["canvas_width"];
+    m_canvasSize.height = (int)node["canvas_height"];
+    for (const auto& view : node["views"])
+    {
+        cv::Mat homography;
+        view["homography"] >> homography;
+        AddView(homography, cv::Size((int)view["width"], (int)view["height"]));
+    }
+}
+
+bool RigCalibration::Save(const std::string& path) const
+{
+    cv::FileStorage fs(path, cv::FileStorage::WRITE);
+    if (!fs.isOpened())
+    {
+        LOG_ERROR("Unable to write rig calibration: %s", path.c_str());
+        return false;
+    }
+    Write(fs);
+    LOG_INFO("Rig calibration is saved: %s", path.c_str());
+    return true;
+}
+
+bool RigCalibration::Load(const std::string& path)
+{
+    cv::FileStorage fs(path, cv::FileStorage::READ);
+    if (!fs.isOpened())
+    {
+        LOG_ERROR("Unable to read rig calibration: %s", path.c_str());
+        return false;
+    }
+    Read(fs.root());
+    if (m_canvasSize.empty() || m_views.empty())
+    {
+        LOG_ERROR("Rig calibration is empty: %s", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+void RigCalibration::buildMap(View& view) const
+{
+    std::vector<cv::Point2f> corners = {
+        cv::Point2f(0, 0), cv::Point2f((float)view.size.width, 0),
+        cv::Point2f((float)view.size.width, (float)view.size.height),
+        cv::Point2f(0, (float)view.size.height)
+    };
+    std::vector<cv::Point2f> warped;
+    cv::perspectiveTransform(corners, warped, view.homography);
+    view.roi = cv::boundingRect(warped)
+        & cv::Rect(0, 0, m_canvasSize.width, m_canvasSize.height);
+    if (view.roi.empty())
+    {
+        return;
+    }
+    cv::Mat inverse = view.homography.inv();
+    const double* h = inverse.ptr<double>(0);
+    cv::Mat mapX(view.roi.size(), CV_32FC1);
+    cv::Mat mapY(view.roi.size(), CV_32FC1);
+    for (int y = 0; y < view.roi.height; ++y)
+    {
+        float* rowX = mapX.ptr<float>(y);
+        float* rowY = mapY.ptr<float>(y);
+        double cy = y + view.roi.y;
+        for (int x = 0; x < view.roi.width; ++x)
+        {
+            double cx = x + view.roi.x;
+            double w = h[6] * cx + h[7] * cy + h[8];
+            w = (0 != w) ? 1.0 / w : 0;
+            rowX[x] = static_cast<float>((h[0] * cx + h[1] * cy + h[2]) * w);
+            rowY[x] = static_cast<float>((h[3] * cx + h[4] * cy + h[5]) * w);
+        }
+    }
+    cv::convertMaps(mapX, mapY, view.mapXY, view.mapInterpolation, CV_16SC2);
+}
+
+void RigCalibration::BuildMaps()
+{
+    for (auto& view : m_views)
+    {
+        if (!view.homography.empty())
+        {
+            buildMap(view);
+        }
+    }
+}
+
+bool RigCalibration::Apply(const std::vector<cv::Mat>& images,
+        cv::Mat& result) const
+{
+    if (images.size() != m_views.size())
+    {
+        LOG_ERROR("Frame set has %d images, the rig has %d views",
+                images.size(), m_views.size());
+        return false;
+    }
+    result.create(m_canvasSize, images.front().type());
+    result.setTo(cv::Scalar::all(0));
+    for (size_t i = 0; i < m_views.size(); ++i)
+    {
+        const View& view = m_views[i];
+        if (view.mapXY.empty())
+        {
+            continue;
+        }
+        if (images[i].size() != view.size)
+        {
+            LOG_ERROR("Image %d is %dx%d, the rig expects %dx%d", i,
+                    images[i].cols, images[i].rows, view.size.width,
+                    view.size.height);
+            return false;
+        }
+        cv::Mat dst = result(view.roi);
+        cv::remap(images[i], dst, view.mapXY, view.mapInterpolation,
+                cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+    }
+    return true;
+}
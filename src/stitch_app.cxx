@@ -1,4 +1,10 @@
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <future>
 #include <iostream>
+#include <set>
+#include <thread>
 
 #include <opencv2/opencv.hpp>
 #include <boost/filesystem.hpp>
@@ -6,28 +12,103 @@
 
 #include "stitch_app.hxx"
 #include "image_stitching.hxx"
+#include "image_processing.hxx"
+#include "feature_cache.hxx"
+#include "image_source.hxx"
+#include "thread_pool.hxx"
+#include "async_writer.hxx"
+#include "rig_calibration.hxx"
+#include "tiled_compositor.hxx"
+#include "batch_runner.hxx"
+#include "overlap_graph.hxx"
+#include "keyframe_selector.hxx"
+#include "image_view.hxx"
 #include "logging.hxx"
+#include "profiler.hxx"
+
+static const std::chrono::seconds SPOOL_POLL_INTERVAL(1);
+static const char* PROJECT_FILE = "project.yml";
 
 StitchApp::StitchApp()
     : m_bQuiet(false)
     , m_bRecurseSearching(false)
+    , m_bChain(false)
+    , m_bTree(false)
+    , m_bAppend(false)
+    , m_bAutoOrder(false)
+    , m_bRefine(false)
+    , m_bLocalOptim(false)
+    , m_bExpired(false)
     , m_keypointsCount(0)
     , m_distanceRatio(0)
     , m_ransacValue(0)
+    , m_workMegapix(0)
+    , m_overlap(0)
+    , m_keyframeOverlap(0)
+    , m_confidence(0)
+    , m_maxIters(0)
+    , m_deadline(0)
+    , m_threadsCount(0)
+    , m_prefetchCount(0)
+    , m_tileSize(0)
+    , m_featherWidth(0)
+    , m_gridSize(0)
+    , m_candidates(0)
+    , m_maxJobs(0)
+    , m_saveEvery(0)
+    , m_jpegQuality(0)
+    , m_pngCompression(0)
+    , m_memoryCap(0)
+    , m_decodeCache(0)
     , m_inputPath("")
     , m_outputPath("")
     , m_logfilePath("")
+    , m_cachePath("")
+    , m_detector("")
+    , m_matcher("")
+    , m_estimator("")
+    , m_videoPath("")
+    , m_calibratePath("")
+    , m_applyPath("")
+    , m_tracePath("")
+    , m_batchPath("")
+    , m_spoolPath("")
+    , m_statusPath("")
+    , m_format("")
+    , m_logFormat("")
+    , m_logLevel("")
+    , m_resultExt("")
     , m_stitcher(nullptr)
+    , m_featureCache(nullptr)
+    , m_imageSource(nullptr)
+    , m_pool(nullptr)
+    , m_writer(nullptr)
     , m_logfileStream(nullptr)
 {
 }
 
 StitchApp::~StitchApp()
 {
+    if (nullptr != m_writer)
+    {
+        delete m_writer;
+    }
+    if (nullptr != m_pool)
+    {
+        delete m_pool;
+    }
     if (nullptr != m_stitcher)
     {
         delete m_stitcher;
     }
+    if (nullptr != m_featureCache)
+    {
+        delete m_featureCache;
+    }
+    if (nullptr != m_imageSource)
+    {
+        delete m_imageSource;
+    }
     closeLogfile();
 }
 
@@ -38,15 +119,97 @@ void StitchApp::createArgList(po::options_description& desc)
         ("quiet,q", "Quiet (No output)")
         ("logfile,l", po::value<std::string>()->default_value(""),
          "Redirect output to the logfile")
-        ("input,i", po::value<std::string>()->required(),
+        ("log-format", po::value<std::string>()->default_value("text"),
+         "Log record format (text, kv, json; ts in ms since the epoch)")
+        ("log-level", po::value<std::string>()->default_value("info"),
+         "Lowest logged level (info, warn, error)")
+        ("input,i", po::value<std::string>()->default_value(""),
          "Source image files directory path")
-        ("output,o", po::value<std::string>()->required(),
+        ("output,o", po::value<std::string>()->default_value(""),
          "Output image files directory path")
         ("keypoints,k",po::value<int>()->default_value(10000),"Keypoints count")
         ("ratio", po::value<float>()->default_value(0.75),
          "Distance filter ratio")
         ("RANSAC,R", po::value<float>()->default_value(1.5), "RANSAC value")
-        ("recurse,r", "Search for images recursively");
+        ("work-megapix", po::value<float>()->default_value(0),
+         "Register at this resolution in megapixels (0 - full resolution)")
+        ("refine", "Refine downscaled registration at full resolution")
+        ("overlap", po::value<float>()->default_value(0),
+         "Expected overlap fraction, detect only where images can overlap "
+         "(0 - whole image)")
+        ("feather", po::value<int>()->default_value(0),
+         "Blend width in pixels along the seams (0 - overwrite, not with "
+         "--tiled)")
+        ("cache", po::value<std::string>()->default_value(""),
+         "Feature cache directory (reuse detected features between runs)")
+        ("grid", po::value<int>()->default_value(0),
+         "Detect on an n x n grid with an equal keypoint budget per cell "
+         "(0 - strongest keypoints of the whole image)")
+        ("detector", po::value<std::string>()->default_value("sift"),
+         "Feature detector (sift, orb, akaze)")
+        ("matcher", po::value<std::string>()->default_value("bf"),
+         "Descriptor matcher (bf, kdtree, lsh)")
+        ("estimator", po::value<std::string>()->default_value("ransac"),
+         "Robust homography estimator (ransac, prosac, usac, magsac)")
+        ("confidence", po::value<double>()->default_value(0.995),
+         "Estimator confidence, stops sampling once reached")
+        ("max-iters", po::value<int>()->default_value(2000),
+         "Estimator iteration limit")
+        ("local-optim", "Local optimisation of the best model (usac family)")
+        ("deadline", po::value<double>()->default_value(0),
+         "Time budget in milliseconds: register coarse first, refine weak "
+         "pairs while time allows, stop at the deadline (0 - no budget)")
+        ("recurse,r", "Search for images recursively")
+        ("chain,c", "Match each image only against the previous input image")
+        ("tree,t", "Stitch adjacent pairs in parallel, then the sub-mosaics")
+        ("append,a", "Stitch only the images that are not yet in the output "
+         "project into its mosaic (chain mode)")
+        ("auto-order", "Order the images by overlap instead of by name "
+         "(not with --chain, --tiled or --calibrate)")
+        ("video", po::value<std::string>()->default_value(""),
+         "Stitch the keyframes of a video file or an image sequence "
+         "pattern (e.g. frames/%05d.png) instead of --input")
+        ("keyframe-overlap", po::value<double>()->default_value(0.6),
+         "Start a new keyframe when the last one covers less of the frame "
+         "(--video)")
+        ("candidates", po::value<int>()->default_value(5),
+         "Most similar images verified as neighbours of each image "
+         "(--auto-order)")
+        ("calibrate", po::value<std::string>()->default_value(""),
+         "Stitch in chain mode and save the rig geometry to the file")
+        ("apply", po::value<std::string>()->default_value(""),
+         "Stitch every frame set with a saved rig geometry (remap only)")
+        ("tiled", po::value<int>()->default_value(0),
+         "Composite tile by tile into result.tif with this tile size "
+         "(multiple of 16, 0 - disabled)")
+        ("threads,j", po::value<int>()->default_value(0),
+         "Worker threads (0 - all cores)")
+        ("prefetch", po::value<int>()->default_value(4),
+         "Images decoded and detected ahead of the stitching step")
+        ("trace", po::value<std::string>()->default_value(""),
+         "Write per-stage timings to the file as a Chrome trace (JSON)")
+        ("batch", po::value<std::string>()->default_value(""),
+         "Stitch every \"input output\" directory pair listed in the file")
+        ("spool", po::value<std::string>()->default_value(""),
+         "Watch the directory for *.job manifests (stops on a 'stop' file)")
+        ("max-jobs", po::value<int>()->default_value(2),
+         "Batch jobs running at once")
+        ("decode-cache", po::value<int>()->default_value(256),
+         "Keep decoded input images up to this size in MB, an image used "
+         "again is not decoded again (0 - no cache)")
+        ("memory-cap", po::value<int>()->default_value(0),
+         "Start no new batch job above this resident size in MB "
+         "(0 - unlimited)")
+        ("status", po::value<std::string>()->default_value(""),
+         "Append a JSON line per finished batch job to the file")
+        ("save-every", po::value<int>()->default_value(1),
+         "Save every k-th intermediate mosaic (0 - the final one only)")
+        ("format", po::value<std::string>()->default_value("jpg"),
+         "Result encoding (jpg, png, raw - uncompressed PPM)")
+        ("jpeg-quality", po::value<int>()->default_value(95),
+         "JPEG quality (0-100)")
+        ("png-compression", po::value<int>()->default_value(1),
+         "PNG compression level (0-9, 0 - fastest)");
 }
 
 bool StitchApp::storeArguments(int argc, char** argv,
@@ -67,13 +230,210 @@ bool StitchApp::storeArguments(int argc, char** argv,
     {
         m_bRecurseSearching = true;
     }
+    if (vm.count("chain"))
+    {
+        m_bChain = true;
+    }
+    if (vm.count("tree"))
+    {
+        m_bTree = true;
+    }
+    if (vm.count("append"))
+    {
+        m_bAppend = true;
+        m_bChain = true;
+    }
+    if (vm.count("auto-order"))
+    {
+        m_bAutoOrder = true;
+    }
+    if (vm.count("refine"))
+    {
+        m_bRefine = true;
+    }
+    if (vm.count("local-optim"))
+    {
+        m_bLocalOptim = true;
+    }
     po::notify(vm);
     m_inputPath = vm["input"].as<std::string>();
     m_outputPath = vm["output"].as<std::string>();
     m_logfilePath = vm["logfile"].as<std::string>();
+    m_logFormat = vm["log-format"].as<std::string>();
+    m_logLevel = vm["log-level"].as<std::string>();
+    if ( "text" != m_logFormat && "kv" != m_logFormat
+            && "json" != m_logFormat )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "log-format",
+                m_logFormat);
+    }
+    if ( "info" != m_logLevel && "warn" != m_logLevel
+            && "error" != m_logLevel )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "log-level",
+                m_logLevel);
+    }
     m_keypointsCount = vm["keypoints"].as<int>();
     m_distanceRatio = vm["ratio"].as<float>();
     m_ransacValue = vm["RANSAC"].as<float>();
+    m_cachePath = vm["cache"].as<std::string>();
+    m_workMegapix = vm["work-megapix"].as<float>();
+    m_overlap = vm["overlap"].as<float>();
+    m_featherWidth = vm["feather"].as<int>();
+    m_gridSize = std::max(0, vm["grid"].as<int>());
+    m_candidates = std::max(1, vm["candidates"].as<int>());
+    m_calibratePath = vm["calibrate"].as<std::string>();
+    m_applyPath = vm["apply"].as<std::string>();
+    m_tracePath = vm["trace"].as<std::string>();
+    m_batchPath = vm["batch"].as<std::string>();
+    m_spoolPath = vm["spool"].as<std::string>();
+    m_statusPath = vm["status"].as<std::string>();
+    m_maxJobs = std::max(1, vm["max-jobs"].as<int>());
+    m_memoryCap = std::max(0, vm["memory-cap"].as<int>());
+    m_decodeCache = std::max(0, vm["decode-cache"].as<int>());
+    m_videoPath = vm["video"].as<std::string>();
+    m_keyframeOverlap = vm["keyframe-overlap"].as<double>();
+    if ( m_batchPath.empty() && m_spoolPath.empty() )
+    {
+        if ( m_inputPath.empty() && m_videoPath.empty() )
+        {
+            throw po::required_option("input");
+        }
+        if ( m_outputPath.empty() )
+        {
+            throw po::required_option("output");
+        }
+    }
+    if ( !m_calibratePath.empty() )
+    {
+        m_bChain = true;
+    }
+    m_tileSize = std::max(0, vm["tiled"].as<int>());
+    if ( 0 != m_tileSize % 16 )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "tiled",
+                std::to_string(m_tileSize));
+    }
+    if ( m_bAppend && (0 != m_tileSize || m_bTree) )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "append",
+                "not supported with --tiled or --tree");
+    }
+    if ( m_bAppend && m_bAutoOrder )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "append",
+                "not supported with --auto-order");
+    }
+    if ( !m_videoPath.empty() )
+    {
+        if ( m_bAppend || m_bTree || m_bAutoOrder || 0 != m_tileSize )
+        {
+            throw po::validation_error(
+                    po::validation_error::invalid_option_value, "video",
+                    "not supported with --append, --tree, --auto-order "
+                    "or --tiled");
+        }
+        if ( m_keyframeOverlap <= 0 || m_keyframeOverlap >= 1 )
+        {
+            throw po::validation_error(
+                    po::validation_error::invalid_option_value,
+                    "keyframe-overlap", std::to_string(m_keyframeOverlap));
+        }
+        m_bChain = true;
+    }
+    if ( 0 != m_tileSize )
+    {
+        m_bChain = true;
+    }
+    if ( m_bAutoOrder && m_bChain )
+    {
+        // A branching order breaks the chain, see OverlapGraph
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "auto-order",
+                "not supported with --chain, --tiled or --calibrate");
+    }
+    m_threadsCount = std::max(0, vm["threads"].as<int>());
+    m_prefetchCount = std::max(1, vm["prefetch"].as<int>());
+    m_detector = vm["detector"].as<std::string>();
+    m_matcher = vm["matcher"].as<std::string>();
+    m_estimator = vm["estimator"].as<std::string>();
+    m_confidence = vm["confidence"].as<double>();
+    m_maxIters = vm["max-iters"].as<int>();
+    m_deadline = vm["deadline"].as<double>();
+    if ( m_deadline < 0 )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "deadline",
+                std::to_string(m_deadline));
+    }
+    if ( 0 != m_deadline && !(m_batchPath.empty() && m_spoolPath.empty()) )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "deadline",
+                "not supported with --batch or --spool");
+    }
+    m_saveEvery = std::max(0, vm["save-every"].as<int>());
+    m_jpegQuality = std::min(100, std::max(0, vm["jpeg-quality"].as<int>()));
+    m_pngCompression = std::min(9,
+            std::max(0, vm["png-compression"].as<int>()));
+    m_format = vm["format"].as<std::string>();
+    if ( "jpg" != m_format && "png" != m_format && "raw" != m_format )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "format",
+                m_format);
+    }
+    m_resultExt = ("raw" == m_format) ? ".ppm" : "." + m_format;
+    if ( "sift" != m_detector && "orb" != m_detector
+            && "akaze" != m_detector )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "detector",
+                m_detector);
+    }
+    if ( m_featherWidth < 0 )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "feather",
+                std::to_string(m_featherWidth));
+    }
+    if ( 0 != m_featherWidth && 0 != m_tileSize )
+    {
+        // Tiles are composed in one pass from the strips, nothing to fade
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "feather",
+                "not supported with --tiled");
+    }
+    if ( "bf" != m_matcher && "kdtree" != m_matcher && "lsh" != m_matcher )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "matcher",
+                m_matcher);
+    }
+    if ( "ransac" != m_estimator && "prosac" != m_estimator
+            && "usac" != m_estimator && "magsac" != m_estimator )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "estimator",
+                m_estimator);
+    }
+    if ( m_confidence <= 0 || m_confidence >= 1 )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "confidence",
+                std::to_string(m_confidence));
+    }
+    if ( m_maxIters <= 0 )
+    {
+        throw po::validation_error(
+                po::validation_error::invalid_option_value, "max-iters",
+                std::to_string(m_maxIters));
+    }
     return true;
 }
 
@@ -91,7 +451,7 @@ int StitchApp::ParseArgs(int argc, char** argv)
     }
     catch ( const po::error& e )
     {
-        Logging::LogError("Failed to parse arguments: %s", e.what());
+        LOG_ERROR("Failed to parse arguments: %s", e.what());
         std::cout << desc << std::endl;
         return -1;
     }
@@ -140,39 +500,576 @@ void sortFilenames(ImageNames& files)
 
 void StitchApp::stitch2Images(const std::string& img1, const std::string& img2)
 {
-    cv::Mat* resultFile = new cv::Mat();
-    m_stitcher->Stitch2Images(img1, img2, resultFile);
-    m_stitcher->SaveFile(m_outputPath, "result_1.jpg", resultFile);
-    if (nullptr != resultFile)
+    cv::Mat result;
+    m_stitcher->Stitch2Images(img1, img2, &result);
+    m_stitcher->SaveFile(m_outputPath, resultName("result_1"), &result);
+}
+
+std::string StitchApp::resultName(const std::string& stem) const
+{
+    return stem + m_resultExt;
+}
+
+bool StitchApp::isSaveStep(int index, bool last) const
+{
+    return last || (0 != m_saveEvery && 0 == index % m_saveEvery);
+}
+
+typedef std::deque<std::future<StitchFrame>> FrameQueue;
+
+void prefetchFrames(ThreadPool& pool, const Stitcher& stitcher,
+        const ImageNames& files, size_t& next, size_t depth, FrameQueue& frames)
+{
+    cv::Mat motion = stitcher.Motion();
+    while (next < files.size() && frames.size() < depth)
     {
-        delete resultFile;
+        const std::string& path = files[next++];
+        frames.push_back(pool.Submit([&stitcher, path, motion]() {
+            StitchFrame frame;
+            // Left empty after the deadline, the caller stops on it
+            if (stitcher.Expired())
+            {
+                return frame;
+            }
+            stitcher.PrepareFrame(path, motion, frame);
+            return frame;
+        }));
     }
 }
 
+StitchFrame waitFrame(FrameQueue& frames)
+{
+    PROFILE_SCOPE("prefetch_wait");
+    return frames.front().get();
+}
+
 void StitchApp::stitchImages(ImageNames& inputFiles)
 {
-    cv::Mat* resultFile = new cv::Mat();
+    PROFILE_SCOPE("stitch_images");
+    cv::Mat result;
     if (inputFiles.size() < 3)
     {
-        m_stitcher->Stitch2Images(inputFiles[0], inputFiles[1], resultFile);
-        m_stitcher->SaveFile(m_outputPath, "result_1.jpg", resultFile);
-        if (nullptr != resultFile)
+        stitch2Images(inputFiles[0], inputFiles[1]);
+        return;
+    }
+    FrameQueue frames;
+    size_t next = 2;
+    prefetchFrames(*m_pool, *m_stitcher, inputFiles, next, m_prefetchCount,
+            frames);
+    m_stitcher->Stitch2Images(inputFiles[0], inputFiles[1], &result);
+    // Two inputs returned above, so the first pair is never the last step
+    if ( isSaveStep(1, false) )
+    {
+        m_stitcher->SaveFile(m_outputPath, resultName("result_1"), &result);
+    }
+    for (int i = 2; i < inputFiles.size(); ++i)
+    {
+        // Checked after the wait, the frame may have been skipped
+        StitchFrame frame = waitFrame(frames);
+        frames.pop_front();
+        if ( deadlineExceeded(i, inputFiles.size()) )
+        {
+            if ( !isSaveStep(i - 1, false) )
+            {
+                std::string resName = resultName("result_"
+                        + std::to_string(i - 1));
+                m_stitcher->SaveFile(m_outputPath, resName, &result);
+            }
+            break;
+        }
+        prefetchFrames(*m_pool, *m_stitcher, inputFiles, next,
+                m_prefetchCount, frames);
+        m_stitcher->StitchToLastResult(frame, &result);
+        if ( !isSaveStep(i, i + 1 == inputFiles.size()) )
+        {
+            continue;
+        }
+        std::string resName = resultName("result_" + std::to_string(i));
+        m_stitcher->SaveFile(m_outputPath, resName, &result);
+    }
+}
+
+/*
+ * Chains files onto result, numbering them from index. stitched receives
+ * the files that registered, the others stay out of the project so a
+ * later --append retries them. Returns the index after the last one that
+ * registered, its mosaic is on disk (not in tiled mode).
+ */
+int StitchApp::chainFiles(const ImageNames& files, cv::Mat& result,
+        int index, ImageNames& stitched)
+{
+    int last = index - 1;
+    // An appended project's mosaic is on disk already
+    int saved = last;
+    FrameQueue frames;
+    size_t next = 0;
+    prefetchFrames(*m_pool, *m_stitcher, files, next, m_prefetchCount,
+            frames);
+    for (size_t i = 0; i < files.size(); ++i, ++index)
+    {
+        // Checked after the wait, the frame may have been skipped
+        StitchFrame frame = waitFrame(frames);
+        frames.pop_front();
+        if ( deadlineExceeded(static_cast<int>(i), files.size()) )
+        {
+            break;
+        }
+        prefetchFrames(*m_pool, *m_stitcher, files, next, m_prefetchCount,
+                frames);
+        if ( !m_stitcher->StitchNext(frame, &result) )
+        {
+            continue;
+        }
+        stitched.push_back(files[i]);
+        last = index;
+        if ( 0 != m_tileSize || 0 == index || !isSaveStep(index, false) )
+        {
+            continue;
+        }
+        std::string resName = resultName("result_" + std::to_string(index));
+        m_stitcher->SaveFile(m_outputPath, resName, &result);
+        saved = index;
+    }
+    // The project points to the last mosaic, result_0 included
+    if ( 0 == m_tileSize && last != saved )
+    {
+        std::string resName = resultName("result_" + std::to_string(last));
+        m_stitcher->SaveFile(m_outputPath, resName, &result);
+    }
+    return last + 1;
+}
+
+/*
+ * Frames are decoded and tracked here, keyframes are detected on the pool
+ * up to --prefetch ahead and chained in order. A frame buffer is only kept
+ * by the keyframes in flight and the last frame, so memory is constant in
+ * the length of the stream.
+ */
+void StitchApp::stitchVideo()
+{
+    PROFILE_SCOPE("stitch_video");
+    cv::VideoCapture capture(m_videoPath);
+    if ( !capture.isOpened() )
+    {
+        LOG_ERROR("Unable to open video: %s", m_videoPath.c_str());
+        exit(-13);
+    }
+    KeyframeSelector selector(m_keyframeOverlap);
+    FrameQueue keyframes;
+    cv::Mat result;
+    cv::Mat last;
+    int frames = 0;
+    int index = 0;
+    int saved = -1;
+    auto submit = [this, &keyframes](const cv::Mat& image, int number) {
+        keyframes.push_back(m_pool->Submit([this, image, number]() {
+            StitchFrame frame;
+            if ( m_stitcher->Expired() )
+            {
+                return frame;
+            }
+            ImageView view;
+            view.data = image.data;
+            view.width = image.cols;
+            view.height = image.rows;
+            view.stride = image.step;
+            m_stitcher->PrepareFrame(view, frame);
+            // The view does not own the pixels, the frame must
+            frame.image = image;
+            frame.path = "frame_" + std::to_string(number);
+            return frame;
+        }));
+    };
+    auto stitchNext = [&]() {
+        StitchFrame frame = waitFrame(keyframes);
+        keyframes.pop_front();
+        if ( deadlineExceeded(index, index + keyframes.size() + 1) )
+        {
+            return;
+        }
+        bool registered = m_stitcher->StitchNext(frame, &result);
+        if ( registered && 0 != index && isSaveStep(index, false) )
+        {
+            std::string resName = resultName("result_"
+                    + std::to_string(index));
+            m_stitcher->SaveFile(m_outputPath, resName, &result);
+            saved = index;
+        }
+        ++index;
+    };
+    bool keyframe = false;
+    while (true)
+    {
+        // A fresh buffer per frame, a keyframe in flight holds on to it
+        cv::Mat frame;
+        if ( deadlineExceeded(index, index + keyframes.size())
+                || !capture.read(frame) )
         {
-            delete resultFile;
+            break;
+        }
+        keyframe = selector.Push(frame);
+        if ( keyframe )
+        {
+            LOG_INFO("Keyframe %d: frame %d, overlap %.2f",
+                    index + static_cast<int>(keyframes.size()), frames,
+                    selector.Overlap());
+            submit(frame, frames);
+            if ( keyframes.size() > static_cast<size_t>(m_prefetchCount) )
+            {
+                stitchNext();
+            }
         }
+        last = frame;
+        ++frames;
+    }
+    // The tail after the last keyframe
+    if ( !keyframe && !last.empty() && !m_bExpired )
+    {
+        submit(last, frames - 1);
+    }
+    while ( !keyframes.empty() && !m_bExpired
+            && !deadlineExceeded(index, index + keyframes.size()) )
+    {
+        stitchNext();
+    }
+    LOG_INFO("Video: %d frames, %d keyframes", frames, index);
+    if ( index < 2 )
+    {
+        LOG_ERROR("Video has no camera motion to stitch");
+    }
+    else if ( saved != index - 1 )
+    {
+        std::string resName = resultName("result_"
+                + std::to_string(index - 1));
+        m_stitcher->SaveFile(m_outputPath, resName, &result);
+    }
+    m_stitcher->EndSequence();
+}
+
+void StitchApp::stitchChain(ImageNames& inputFiles)
+{
+    PROFILE_SCOPE("stitch_chain");
+    cv::Mat result;
+    ImageNames stitched;
+    int count = chainFiles(inputFiles, result, 0, stitched);
+    if ( 0 != m_tileSize || stitched.empty() )
+    {
         return;
     }
-    m_stitcher->Stitch2Images(inputFiles[0], inputFiles[1], resultFile);
-    m_stitcher->SaveFile(m_outputPath, "result_1.jpg", resultFile);
-    for (int i = 2; i < inputFiles.size(); ++i)
+    saveProject(stitched, count);
+}
+
+void StitchApp::saveProject(const ImageNames& files, int count)
+{
+    fs::path path = fs::path(m_outputPath) / PROJECT_FILE;
+    // The project must never point to a mosaic that is not on disk yet
+    m_writer->Flush();
+    cv::FileStorage project(path.string(), cv::FileStorage::WRITE);
+    if ( !project.isOpened() )
     {
-        m_stitcher->StitchToLastResult(inputFiles[i], resultFile);
-        std::string resName = "result_" + std::to_string(i) + ".jpg";
-        m_stitcher->SaveFile(m_outputPath, resName, resultFile);
+        LOG_ERROR("Unable to write project: %s", path.string().c_str());
+        return;
+    }
+    project << "result" << resultName("result_" + std::to_string(count - 1));
+    project << "next_index" << count;
+    project << "images" << "[";
+    for (const auto& file : files)
+    {
+        project << file;
+    }
+    project << "]";
+    project << "state" << "{";
+    bool saved = m_stitcher->WriteState(project, m_outputPath);
+    project << "}";
+    project.release();
+    if ( !saved )
+    {
+        fs::remove(path);
+        return;
+    }
+    LOG_INFO("Project is saved: %s", path.string().c_str());
+}
+
+void StitchApp::appendImages(ImageNames& inputFiles)
+{
+    PROFILE_SCOPE("append");
+    fs::path path = fs::path(m_outputPath) / PROJECT_FILE;
+    cv::FileStorage project(path.string(), cv::FileStorage::READ);
+    if ( !project.isOpened() )
+    {
+        LOG_WARN("No project in the output, stitching all images");
+        stitchChain(inputFiles);
+        return;
+    }
+    ImageNames files;
+    for (const auto& node : project["images"])
+    {
+        files.push_back((std::string)node);
+    }
+    std::set<std::string> stitched(files.begin(), files.end());
+    ImageNames added;
+    for (const auto& file : inputFiles)
+    {
+        if ( 0 == stitched.count(file) )
+        {
+            added.push_back(file);
+        }
+    }
+    if ( added.empty() )
+    {
+        LOG_INFO("Nothing to append, the project is up to date");
+        return;
+    }
+    fs::path mosaicPath = fs::path(m_outputPath)
+        / (std::string)project["result"];
+    cv::Mat result = cv::imread(mosaicPath.string());
+    if ( !m_stitcher->ReadState(project["state"], m_outputPath, &result) )
+    {
+        LOG_ERROR("Unable to restore project: %s",
+                path.string().c_str());
+        exit(-11);
+    }
+    LOG_INFO("Appending %d images to %s", added.size(),
+            mosaicPath.string().c_str());
+    ImageNames registered;
+    int count = chainFiles(added, result, (int)project["next_index"],
+            registered);
+    project.release();
+    if ( registered.empty() )
+    {
+        LOG_WARN("No image registered, the project is unchanged");
+        return;
+    }
+    files.insert(files.end(), registered.begin(), registered.end());
+    saveProject(files, count);
+}
+
+/*
+ * A run of adjacent inputs after reduction: normally one sub-mosaic, more
+ * when a pair failed to register and both sides were carried up.
+ */
+struct TreeNode
+{
+    std::vector<StitchFrame> mosaics;
+    std::vector<ImageNames> files;
+};
+
+TreeNode mergeNodes(const Stitcher& stitcher, TreeNode left, TreeNode right)
+{
+    StitchFrame merged;
+    if (stitcher.StitchPair(left.mosaics.back(), right.mosaics.front(),
+                merged))
+    {
+        left.mosaics.back() = std::move(merged);
+        ImageNames& files = left.files.back();
+        files.insert(files.end(), right.files.front().begin(),
+                right.files.front().end());
+        right.mosaics.erase(right.mosaics.begin());
+        right.files.erase(right.files.begin());
     }
-    if (nullptr != resultFile)
+    for (size_t i = 0; i < right.mosaics.size(); ++i)
     {
-        delete resultFile;
+        left.mosaics.push_back(std::move(right.mosaics[i]));
+        left.files.push_back(std::move(right.files[i]));
+    }
+    return left;
+}
+
+bool nodeReady(std::future<TreeNode>& node)
+{
+    return std::future_status::ready
+        == node.wait_for(std::chrono::seconds(0));
+}
+
+/*
+ * Leaves come through the bounded prefetch and are reduced like a binary
+ * counter: two adjacent nodes of equal depth are merged on the pool once
+ * both are done, so only about log2(n) sub-mosaics plus the merges in
+ * flight are held at a time.
+ */
+void StitchApp::stitchTree(ImageNames& inputFiles)
+{
+    PROFILE_SCOPE("stitch_tree");
+    struct Entry
+    {
+        int depth;
+        std::future<TreeNode> node;
+    };
+    std::vector<Entry> stack;
+    size_t maxPending = static_cast<size_t>(m_prefetchCount)
+        + static_cast<size_t>(std::log2(inputFiles.size())) + 1;
+    auto collapse = [this, &stack](bool wait) {
+        while (stack.size() >= 2)
+        {
+            Entry& left = stack[stack.size() - 2];
+            Entry& right = stack.back();
+            if (!wait && (left.depth != right.depth || !nodeReady(left.node)
+                        || !nodeReady(right.node)))
+            {
+                break;
+            }
+            auto nodes = std::make_shared<std::pair<TreeNode, TreeNode>>(
+                    left.node.get(), right.node.get());
+            int depth = std::max(left.depth, right.depth) + 1;
+            stack.pop_back();
+            stack.back() = { depth, m_pool->Submit([this, nodes]() {
+                return mergeNodes(*m_stitcher, std::move(nodes->first),
+                        std::move(nodes->second));
+            }) };
+        }
+    };
+    FrameQueue frames;
+    size_t next = 0;
+    prefetchFrames(*m_pool, *m_stitcher, inputFiles, next, m_prefetchCount,
+            frames);
+    for (size_t i = 0; i < inputFiles.size(); ++i)
+    {
+        StitchFrame frame = waitFrame(frames);
+        frames.pop_front();
+        // The merges in flight fail on their own after the deadline
+        if ( deadlineExceeded(static_cast<int>(i), inputFiles.size()) )
+        {
+            break;
+        }
+        prefetchFrames(*m_pool, *m_stitcher, inputFiles, next,
+                m_prefetchCount, frames);
+        if ( frame.image.empty() )
+        {
+            LOG_ERROR("Image dropped, unable to read it: %s",
+                    inputFiles[i].c_str());
+            continue;
+        }
+        std::promise<TreeNode> leaf;
+        TreeNode node;
+        node.mosaics.push_back(std::move(frame));
+        node.files.push_back(ImageNames(1, inputFiles[i]));
+        leaf.set_value(std::move(node));
+        stack.push_back({ 0, leaf.get_future() });
+        collapse(false);
+        // Merges fall behind the leaves, wait for them
+        if ( stack.size() > maxPending )
+        {
+            collapse(true);
+        }
+    }
+    if ( stack.empty() )
+    {
+        LOG_ERROR("No image to stitch");
+        return;
+    }
+    collapse(true);
+    TreeNode root = stack.front().node.get();
+    size_t largest = 0;
+    for (size_t i = 1; i < root.files.size(); ++i)
+    {
+        if ( root.files[i].size() > root.files[largest].size() )
+        {
+            largest = i;
+        }
+    }
+    for (size_t i = 0; i < root.files.size(); ++i)
+    {
+        if ( i == largest )
+        {
+            continue;
+        }
+        for (const auto& file : root.files[i])
+        {
+            LOG_ERROR("Image dropped, its group did not register "
+                    "to the mosaic: %s", file.c_str());
+        }
+    }
+    m_stitcher->SaveFile(m_outputPath, resultName("result"),
+            &root.mosaics[largest].image);
+}
+
+void StitchApp::composeTiles(ImageNames& inputFiles)
+{
+    PROFILE_SCOPE("compose_tiles");
+    TiledCompositor compositor(*m_pool, m_tileSize);
+    fs::path path = fs::path(m_outputPath) / "result.tif";
+    ImageNames files = inputFiles;
+    if ( m_bExpired )
+    {
+        // The chain stopped at the deadline, composite what it registered
+        files.resize(std::min(files.size(), m_stitcher->Rig().ViewsCount()));
+    }
+    if ( !compositor.Compose(files, m_stitcher->Rig(), path.string()) )
+    {
+        LOG_ERROR("Failed to composite tiles");
+        exit(-7);
+    }
+    LOG_INFO("Result file is saved: %s", path.string().c_str());
+}
+
+void StitchApp::saveRig()
+{
+    if ( !m_stitcher->Rig().Save(m_calibratePath) )
+    {
+        exit(-6);
+    }
+}
+
+void listFrameSets(const fs::path& root, std::vector<fs::path>& sets)
+{
+    for (const auto& entry : fs::directory_iterator(root))
+    {
+        if (fs::is_directory(entry.status()))
+        {
+            sets.push_back(entry.path());
+        }
+    }
+    std::sort(sets.begin(), sets.end());
+    if (sets.empty())
+    {
+        sets.push_back(root);
+    }
+}
+
+void StitchApp::applyRig()
+{
+    PROFILE_SCOPE("apply_rig");
+    RigCalibration rig;
+    if ( !rig.Load(m_applyPath) )
+    {
+        exit(-6);
+    }
+    rig.BuildMaps();
+    std::vector<fs::path> sets;
+    listFrameSets(m_inputPath, sets);
+    for (const auto& set : sets)
+    {
+        ImageNames files;
+        for (const auto& entry : fs::directory_iterator(set))
+        {
+            if (fs::is_regular_file(entry.status()))
+            {
+                files.push_back(entry.path().string());
+            }
+        }
+        sortFilenames(files);
+        std::vector<std::future<cv::Mat>> decoded;
+        for (const auto& file : files)
+        {
+            decoded.push_back(m_pool->Submit([this, file]() {
+                PROFILE_SCOPE("decode");
+                return m_imageSource->Read(file);
+            }));
+        }
+        std::vector<cv::Mat> images;
+        for (auto& image : decoded)
+        {
+            images.push_back(image.get());
+        }
+        cv::Mat result;
+        if ( !rig.Apply(images, result) )
+        {
+            LOG_ERROR("Frame set skipped: %s", set.string().c_str());
+            continue;
+        }
+        std::string resName = resultName((sets.size() == 1) ? "result"
+                : "result_" + set.filename().string());
+        m_stitcher->SaveFile(m_outputPath, resName, &result);
     }
 }
 
@@ -180,30 +1077,204 @@ void StitchApp::stitch(ImageNames& inputFiles)
 {
     if (inputFiles.size() < 2)
     {
-        Logging::LogError("Images list is empty");
+        LOG_ERROR("Images list is empty");
         exit(-1);
     }
-    if (inputFiles.size() == 2)
+    if (m_bAppend)
+    {
+        appendImages(inputFiles);
+    }
+    else if (m_bTree)
+    {
+        stitchTree(inputFiles);
+    }
+    else if (m_bChain)
+    {
+        stitchChain(inputFiles);
+        if ( 0 != m_tileSize )
+        {
+            composeTiles(inputFiles);
+        }
+    }
+    else if (inputFiles.size() == 2)
     {
         stitch2Images(inputFiles[0], inputFiles[1]);
-        return;
     }
-    stitchImages(inputFiles);
+    else
+    {
+        stitchImages(inputFiles);
+    }
+    // The sequence results were locals of the modes above
+    m_stitcher->EndSequence();
+}
+
+void StitchApp::pollSpool(BatchRunner& runner)
+{
+    fs::path spool(m_spoolPath);
+    LOG_INFO("Watching spool directory: %s", m_spoolPath.c_str());
+    while ( !fs::exists(spool / "stop") )
+    {
+        std::vector<fs::path> manifests;
+        for (const auto& entry : fs::directory_iterator(spool))
+        {
+            if (fs::is_regular_file(entry.status())
+                    && ".job" == entry.path().extension())
+            {
+                manifests.push_back(entry.path());
+            }
+        }
+        std::sort(manifests.begin(), manifests.end());
+        for (const auto& manifest : manifests)
+        {
+            BatchJobs jobs;
+            bool loaded = BatchRunner::LoadManifest(manifest.string(), jobs);
+            fs::path claimed = manifest;
+            claimed.replace_extension(loaded ? ".queued" : ".invalid");
+            boost::system::error_code ec;
+            fs::rename(manifest, claimed, ec);
+            if ( ec )
+            {
+                // Left in place, the next poll claims it again
+                LOG_ERROR("Unable to claim manifest %s: %s",
+                        manifest.string().c_str(), ec.message().c_str());
+                continue;
+            }
+            for (const auto& job : jobs)
+            {
+                runner.Add(job);
+            }
+        }
+        std::this_thread::sleep_for(SPOOL_POLL_INTERVAL);
+    }
+}
+
+int StitchApp::runBatch()
+{
+    PROFILE_SCOPE("batch");
+    BatchRunner runner(*m_stitcher, *m_pool, m_maxJobs, m_memoryCap,
+            m_statusPath);
+    runner.SetEncoder(m_resultExt, m_encodeParams);
+    if ( !m_batchPath.empty() )
+    {
+        BatchJobs jobs;
+        if ( !BatchRunner::LoadManifest(m_batchPath, jobs) )
+        {
+            exit(-9);
+        }
+        for (const auto& job : jobs)
+        {
+            runner.Add(job);
+        }
+    }
+    if ( !m_spoolPath.empty() )
+    {
+        if ( !fs::is_directory(m_spoolPath) )
+        {
+            LOG_ERROR("Spool path is not a directory: %s",
+                    m_spoolPath.c_str());
+            exit(-9);
+        }
+        pollSpool(runner);
+    }
+    size_t failed = runner.Finish();
+    LOG_INFO("Batch finished, %d jobs failed", failed);
+    return (0 == failed) ? 0 : -10;
+}
+
+void StitchApp::initStitcher()
+{
+    m_pool = new ThreadPool(m_threadsCount);
+    if ( "jpg" == m_format )
+    {
+        m_encodeParams = { cv::IMWRITE_JPEG_QUALITY, m_jpegQuality };
+    }
+    else if ( "png" == m_format )
+    {
+        m_encodeParams = { cv::IMWRITE_PNG_COMPRESSION, m_pngCompression };
+    }
+    m_writer = new AsyncWriter(2, m_encodeParams);
+    m_stitcher = new Stitcher(m_distanceRatio, m_keypointsCount, m_ransacValue);
+    m_stitcher->SetWriter(m_writer);
+    m_imageSource = new ImageSource(m_decodeCache);
+    m_stitcher->SetImageSource(m_imageSource);
+    m_stitcher->SetWorkResolution(m_workMegapix, m_bRefine);
+    m_stitcher->SetOverlap(m_overlap);
+    m_stitcher->SetCompositing(0 == m_tileSize);
+    m_stitcher->SetFeather(m_featherWidth);
+    m_stitcher->SetGrid(m_gridSize);
+    if ( !m_cachePath.empty() )
+    {
+        m_featureCache = new FeatureCache(m_cachePath);
+        m_stitcher->SetFeatureCache(m_featureCache);
+    }
+    if ( "orb" == m_detector )
+    {
+        m_stitcher->SetDetectorType(DetectorType::ORB);
+    }
+    else if ( "akaze" == m_detector )
+    {
+        m_stitcher->SetDetectorType(DetectorType::AKAZE);
+    }
+    if ( "kdtree" == m_matcher )
+    {
+        m_stitcher->SetMatcherType(MatcherType::KDTREE);
+    }
+    else if ( "lsh" == m_matcher )
+    {
+        m_stitcher->SetMatcherType(MatcherType::LSH);
+    }
+    EstimatorParams estimator;
+    estimator.confidence = m_confidence;
+    estimator.maxIters = m_maxIters;
+    estimator.localOptimization = m_bLocalOptim;
+    if ( "prosac" == m_estimator )
+    {
+        estimator.type = EstimatorType::PROSAC;
+    }
+    else if ( "usac" == m_estimator )
+    {
+        estimator.type = EstimatorType::USAC;
+    }
+    else if ( "magsac" == m_estimator )
+    {
+        estimator.type = EstimatorType::MAGSAC;
+    }
+    m_stitcher->SetEstimator(estimator);
+    if ( 0 != m_deadline )
+    {
+        m_stitcher->SetDeadline(m_deadline);
+    }
 }
 
 void StitchApp::initLogging()
 {
+    if ( "kv" == m_logFormat )
+    {
+        Logging::SetFormat(LogFormat::KEY_VALUE);
+    }
+    else if ( "json" == m_logFormat )
+    {
+        Logging::SetFormat(LogFormat::JSON);
+    }
+    if ( "warn" == m_logLevel )
+    {
+        Logging::SetLevel(LogType::WARN);
+    }
+    else if ( "error" == m_logLevel )
+    {
+        Logging::SetLevel(LogType::ERROR);
+    }
     if ( !m_logfilePath.empty() )
     {
         if ( fs::exists(m_logfilePath) )
         {
             if ( !fs::is_directory(m_logfilePath) )
             {
-                Logging::LogWarn("The logfile aleady exists (overwriting)");
+                LOG_WARN("The logfile aleady exists (overwriting)");
             }
             else
             {
-                Logging::LogError("In your logfile path was located directory");
+                LOG_ERROR("In your logfile path was located directory");
                 exit(-2);
             }
         }
@@ -221,14 +1292,14 @@ void StitchApp::checkForOutputDir()
     {
         if ( !fs::is_directory(m_outputPath) )
         {
-            Logging::LogError("Output path is not a directory: %s",
+            LOG_ERROR("Output path is not a directory: %s",
                     m_outputPath.c_str());
             exit(-3);
         }
     }
     else
     {
-        Logging::LogError("Output path does not exists: %s",
+        LOG_ERROR("Output path does not exists: %s",
                 m_outputPath.c_str());
         exit(-4);
     }
@@ -238,22 +1309,107 @@ void StitchApp::loadFiles(ImageNames& inputFiles)
 {
     if ( 0 != loadSourceFiles(inputFiles) )
     {
-        Logging::LogError("Invalid input path: %s", m_inputPath.c_str());
+        LOG_ERROR("Invalid input path: %s", m_inputPath.c_str());
         exit(-5);
     }
     sortFilenames(inputFiles);
+    if ( m_bAutoOrder )
+    {
+        autoOrder(inputFiles);
+    }
+}
+
+void StitchApp::autoOrder(ImageNames& inputFiles)
+{
+    OverlapGraph graph(*m_pool, *m_imageSource, m_candidates);
+    if ( !graph.Build(inputFiles) )
+    {
+        LOG_ERROR("Unable to order the input images");
+        exit(-12);
+    }
+    ImageNames ordered;
+    for (size_t index : graph.Order())
+    {
+        ordered.push_back(inputFiles[index]);
+        LOG_INFO("Order: %s", inputFiles[index].c_str());
+    }
+    inputFiles.swap(ordered);
+}
+
+bool StitchApp::deadlineExceeded(int stitched, size_t total)
+{
+    if ( m_bExpired )
+    {
+        return true;
+    }
+    if ( !m_stitcher->Expired() )
+    {
+        return false;
+    }
+    LOG_ERROR("Deadline exceeded after %d of %d images", stitched,
+            total);
+    m_bExpired = true;
+    return true;
+}
+
+void StitchApp::logQualities() const
+{
+    std::vector<PairQuality> qualities = m_stitcher->Qualities();
+    std::vector<int> levels;
+    for (size_t i = 0; i < qualities.size(); ++i)
+    {
+        const PairQuality& quality = qualities[i];
+        if ( quality.expired )
+        {
+            LOG_INFO("Pair %d: expired", i);
+            continue;
+        }
+        QualityLevel level = m_stitcher->Level(quality.level);
+        LOG_INFO("Pair %d: level %d (%.2f MP, %d keypoints), "
+                "inliers %d/%d, consistency %.2f, %.1f ms%s", i,
+                quality.level, level.megapix, level.keypoints,
+                quality.inliers, quality.matches, quality.consistency,
+                quality.ms, quality.weak ? ", weak" : "");
+        if ( levels.size() <= static_cast<size_t>(quality.level) )
+        {
+            levels.resize(quality.level + 1, 0);
+        }
+        ++levels[quality.level];
+    }
+    for (size_t level = 0; level < levels.size(); ++level)
+    {
+        LOG_INFO("Level %d: %d pairs", level, levels[level]);
+    }
+}
+
+void StitchApp::flushResults()
+{
+    {
+        PROFILE_SCOPE("flush");
+        m_writer->Flush();
+    }
+    if ( m_tracePath.empty() )
+    {
+        return;
+    }
+    Profiler::LogSummary();
+    if ( !Profiler::WriteTrace(m_tracePath) )
+    {
+        exit(-8);
+    }
 }
 
 void StitchApp::closeLogfile()
 {
     if ( nullptr != m_logfileStream )
     {
+        // Writes out the queued records before the stream goes away
+        Logging::UnsetOutputStream();
         if ( m_logfileStream->is_open() )
         {
             m_logfileStream->close();
         }
         delete m_logfileStream;
-        Logging::UnsetOutputStream();
     }
 }
 
@@ -268,10 +1424,43 @@ int StitchApp::Exec()
     {
         initLogging();
     }
-    m_stitcher = new Stitcher(m_distanceRatio, m_keypointsCount, m_ransacValue);
+    if ( !m_tracePath.empty() )
+    {
+        Profiler::Enable();
+    }
+    initStitcher();
+    if ( !m_batchPath.empty() || !m_spoolPath.empty() )
+    {
+        ec = runBatch();
+        flushResults();
+        return ec;
+    }
     checkForOutputDir();
-    ImageNames inputFiles;
-    loadFiles(inputFiles);
-    stitch(inputFiles);
-    return 0;
+    if ( !m_applyPath.empty() )
+    {
+        applyRig();
+    }
+    else
+    {
+        if ( !m_videoPath.empty() )
+        {
+            stitchVideo();
+        }
+        else
+        {
+            ImageNames inputFiles;
+            loadFiles(inputFiles);
+            stitch(inputFiles);
+        }
+        if ( !m_calibratePath.empty() )
+        {
+            saveRig();
+        }
+    }
+    if ( 0 != m_deadline )
+    {
+        logQualities();
+    }
+    flushResults();
+    return m_bExpired ? -14 : 0;
 }
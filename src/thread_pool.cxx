@@ -0,0 +1,116 @@
+#include <algorithm>
+
+#include "thread_pool.hxx"
+
+namespace {
+
+thread_local const ThreadPool* t_pool = nullptr;
+thread_local size_t t_queueIndex = 0;
+
+} // namespace
+
+ThreadPool::ThreadPool(size_t threadsCount)
+    : m_bStopping(false)
+    , m_pending(0)
+    , m_nextQueue(0)
+{
+    if (0 == threadsCount)
+    {
+        threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < threadsCount; ++i)
+    {
+        m_queues.emplace_back(new WorkQueue());
+    }
+    for (size_t i = 0; i < threadsCount; ++i)
+    {
+        m_workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bStopping = true;
+    }
+    m_cv.notify_all();
+    for (auto& worker : m_workers)
+    {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::Size() const
+{
+    return m_workers.size();
+}
+
+void ThreadPool::enqueue(std::function<void()> task)
+{
+    size_t index = (this == t_pool) ? t_queueIndex
+        : m_nextQueue.fetch_add(1, std::memory_order_relaxed)
+            % m_queues.size();
+    {
+        std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+        m_queues[index]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_pending;
+    }
+    m_cv.notify_one();
+}
+
+bool ThreadPool::popTask(size_t index, std::function<void()>& task)
+{
+    {
+        WorkQueue& own = *m_queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < m_queues.size(); ++i)
+    {
+        WorkQueue& victim = *m_queues[(index + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::workerLoop(size_t index)
+{
+    t_pool = this;
+    t_queueIndex = index;
+    for (;;)
+    {
+        std::function<void()> task;
+        if (popTask(index, task))
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                --m_pending;
+            }
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this]() {
+            return m_bStopping || 0 != m_pending;
+        });
+        if (m_bStopping && 0 == m_pending)
+        {
+            return;
+        }
+    }
+}
@@ -0,0 +1,178 @@
+#include <opencv2/opencv.hpp>
+
+#include "tiff_writer.hxx"
+#include "logging.hxx"
+
+namespace {
+
+const uint16_t TIFF_SHORT = 3;
+const uint16_t TIFF_LONG = 4;
+const uint16_t TIFF_LONG8 = 16;
+const uint16_t BIGTIFF_VERSION = 43;
+const uint64_t BIGTIFF_HEADER_SIZE = 16;
+const int SAMPLES_PER_PIXEL = 3;
+
+} // namespace
+
+TiffWriter::TiffWriter()
+    : m_width(0)
+    , m_height(0)
+    , m_tileSize(0)
+{
+}
+
+TiffWriter::~TiffWriter()
+{
+    if (m_os.is_open())
+    {
+        Close();
+    }
+}
+
+int TiffWriter::TilesAcross() const
+{
+    return (m_width + m_tileSize - 1) / m_tileSize;
+}
+
+int TiffWriter::TilesDown() const
+{
+    return (m_height + m_tileSize - 1) / m_tileSize;
+}
+
+bool TiffWriter::Open(const std::string& path, int width, int height,
+        int tileSize)
+{
+    if (0 != tileSize % 16 || tileSize <= 0 || width <= 0 || height <= 0)
+    {
+        LOG_ERROR("Invalid TIFF geometry %dx%d, tile %d (tile size "
+                "must be a multiple of 16)", width, height, tileSize);
+        return false;
+    }
+    m_os.open(path, std::ios::binary | std::ios::trunc);
+    if (!m_os.is_open())
+    {
+        LOG_ERROR("Unable to open output file: %s", path.c_str());
+        return false;
+    }
+    m_path = path;
+    m_width = width;
+    m_height = height;
+    m_tileSize = tileSize;
+    size_t tilesCount = static_cast<size_t>(TilesAcross()) * TilesDown();
+    m_tileOffsets.assign(tilesCount, 0);
+    m_tileByteCounts.assign(tilesCount, 0);
+    m_buffer.resize(static_cast<size_t>(tileSize) * tileSize
+            * SAMPLES_PER_PIXEL);
+    m_os.write("II", 2);
+    writeU16(BIGTIFF_VERSION);
+    writeU16(8);
+    writeU16(0);
+    writeU64(0);
+    return true;
+}
+
+void TiffWriter::writeU16(uint16_t value)
+{
+    char bytes[2] = { (char)(value & 0xff), (char)(value >> 8) };
+    m_os.write(bytes, sizeof(bytes));
+}
+
+void TiffWriter::writeU64(uint64_t value)
+{
+    char bytes[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        bytes[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+    m_os.write(bytes, sizeof(bytes));
+}
+
+bool TiffWriter::WriteTile(int tileX, int tileY, const cv::Mat& tile)
+{
+    if (!m_os.is_open() || CV_8UC3 != tile.type() || tileX < 0 || tileY < 0
+            || tileX >= TilesAcross() || tileY >= TilesDown())
+    {
+        return false;
+    }
+    // Edge tiles are padded, TIFF tiles always have the full size
+    std::fill(m_buffer.begin(), m_buffer.end(), 0);
+    int rows = std::min(tile.rows, m_tileSize);
+    int cols = std::min(tile.cols, m_tileSize);
+    for (int y = 0; y < rows; ++y)
+    {
+        const uchar* src = tile.ptr<uchar>(y);
+        char* dst = m_buffer.data()
+            + static_cast<size_t>(y) * m_tileSize * SAMPLES_PER_PIXEL;
+        for (int x = 0; x < cols; ++x)
+        {
+            dst[3 * x] = src[3 * x + 2];
+            dst[3 * x + 1] = src[3 * x + 1];
+            dst[3 * x + 2] = src[3 * x];
+        }
+    }
+    size_t index = static_cast<size_t>(tileY) * TilesAcross() + tileX;
+    m_tileOffsets[index] = static_cast<uint64_t>(m_os.tellp());
+    m_tileByteCounts[index] = m_buffer.size();
+    m_os.write(m_buffer.data(), m_buffer.size());
+    return static_cast<bool>(m_os);
+}
+
+void TiffWriter::writeEntry(uint16_t tag, uint16_t type, uint64_t count,
+        uint64_t value)
+{
+    writeU16(tag);
+    writeU16(type);
+    writeU64(count);
+    writeU64(value);
+}
+
+uint64_t TiffWriter::writeArray(const std::vector<uint64_t>& values)
+{
+    uint64_t offset = static_cast<uint64_t>(m_os.tellp());
+    for (uint64_t value : values)
+    {
+        writeU64(value);
+    }
+    return offset;
+}
+
+bool TiffWriter::Close()
+{
+    if (!m_os.is_open())
+    {
+        return false;
+    }
+    uint64_t tilesCount = m_tileOffsets.size();
+    uint64_t offsets = m_tileOffsets.front();
+    uint64_t byteCounts = m_tileByteCounts.front();
+    if (tilesCount > 1)
+    {
+        offsets = writeArray(m_tileOffsets);
+        byteCounts = writeArray(m_tileByteCounts);
+    }
+    uint64_t ifdOffset = static_cast<uint64_t>(m_os.tellp());
+    // BitsPerSample 8,8,8 packed as three shorts inside the value field
+    uint64_t bitsPerSample = 8 | (8ULL << 16) | (8ULL << 32);
+    writeU64(11);
+    writeEntry(256, TIFF_LONG, 1, static_cast<uint64_t>(m_width));
+    writeEntry(257, TIFF_LONG, 1, static_cast<uint64_t>(m_height));
+    writeEntry(258, TIFF_SHORT, SAMPLES_PER_PIXEL, bitsPerSample);
+    writeEntry(259, TIFF_SHORT, 1, 1);
+    writeEntry(262, TIFF_SHORT, 1, 2);
+    writeEntry(277, TIFF_SHORT, 1, SAMPLES_PER_PIXEL);
+    writeEntry(284, TIFF_SHORT, 1, 1);
+    writeEntry(322, TIFF_LONG, 1, static_cast<uint64_t>(m_tileSize));
+    writeEntry(323, TIFF_LONG, 1, static_cast<uint64_t>(m_tileSize));
+    writeEntry(324, TIFF_LONG8, tilesCount, offsets);
+    writeEntry(325, TIFF_LONG8, tilesCount, byteCounts);
+    writeU64(0);
+    m_os.seekp(BIGTIFF_HEADER_SIZE - 8);
+    writeU64(ifdOffset);
+    m_os.close();
+    bool ok = !m_os.fail();
+    if (!ok)
+    {
+        LOG_ERROR("Failed to write output file: %s", m_path.c_str());
+    }
+    return ok;
+}
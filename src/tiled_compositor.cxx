@@ -0,0 +1,174 @@
+#include <deque>
+#include <future>
+
+#include <opencv2/opencv.hpp>
+
+#include "tiled_compositor.hxx"
+#include "rig_calibration.hxx"
+#include "thread_pool.hxx"
+#include "tiff_writer.hxx"
+#include "logging.hxx"
+#include "profiler.hxx"
+
+// Source pixels kept around a strip for the bilinear interpolation
+static const int STRIP_MARGIN = 2;
+
+TiledCompositor::TiledCompositor(ThreadPool& pool, int tileSize)
+    : m_pool(pool)
+    , m_tileSize(tileSize)
+{
+}
+
+void TiledCompositor::composeTile(const std::vector<Strip>& strips,
+        const std::vector<cv::Rect>& bounds, const cv::Rect& tile,
+        cv::Mat& res) const
+{
+    PROFILE_SCOPE("compose_tile");
+    res.create(tile.size(), CV_8UC3);
+    res.setTo(cv::Scalar::all(0));
+    for (size_t i = 0; i < strips.size(); ++i)
+    {
+        cv::Rect area = bounds[i] & tile;
+        if (strips[i].image.empty() || area.empty())
+        {
+            continue;
+        }
+        cv::Mat translation = (cv::Mat_<double>(3, 3) <<
+                1, 0, -area.x,
+                0, 1, -area.y,
+                0, 0, 1);
+        cv::Mat homography = translation * strips[i].homography;
+        cv::Mat dst = res(cv::Rect(area.x - tile.x, area.y - tile.y,
+                    area.width, area.height));
+        cv::warpPerspective(strips[i].image, dst, homography, dst.size(),
+                cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+    }
+}
+
+/*
+ * Decodes file and keeps the part of it that homography maps into the
+ * canvas area, with a margin for the interpolation.
+ */
+TiledCompositor::Strip TiledCompositor::loadStrip(const std::string& file,
+        const cv::Mat& homography, const cv::Rect& area)
+{
+    Strip strip;
+    cv::Mat image;
+    {
+        PROFILE_SCOPE("decode");
+        image = cv::imread(file);
+    }
+    if (image.empty())
+    {
+        LOG_ERROR("Unable to read image file: %s", file.c_str());
+        return strip;
+    }
+    std::vector<cv::Point2f> corners = {
+        cv::Point2f((float)area.x, (float)area.y),
+        cv::Point2f((float)area.br().x, (float)area.y),
+        cv::Point2f((float)area.br().x, (float)area.br().y),
+        cv::Point2f((float)area.x, (float)area.br().y)
+    };
+    std::vector<cv::Point2f> source;
+    cv::perspectiveTransform(corners, source, homography.inv());
+    cv::Rect region = cv::boundingRect(source);
+    region = cv::Rect(region.x - STRIP_MARGIN, region.y - STRIP_MARGIN,
+            region.width + 2 * STRIP_MARGIN, region.height + 2 * STRIP_MARGIN)
+        & cv::Rect(0, 0, image.cols, image.rows);
+    if (region.empty())
+    {
+        return strip;
+    }
+    strip.image = image(region).clone();
+    cv::Mat offset = (cv::Mat_<double>(3, 3) <<
+            1, 0, region.x,
+            0, 1, region.y,
+            0, 0, 1);
+    strip.homography = homography * offset;
+    return strip;
+}
+
+bool TiledCompositor::Compose(const std::vector<std::string>& files,
+        const RigCalibration& rig, const std::string& outputPath) const
+{
+    if (files.size() != rig.ViewsCount())
+    {
+        LOG_ERROR("Registered %d of %d images, cannot composite",
+                rig.ViewsCount(), files.size());
+        return false;
+    }
+    const cv::Size& canvas = rig.CanvasSize();
+    cv::Rect canvasRect(0, 0, canvas.width, canvas.height);
+    std::vector<cv::Rect> bounds(files.size());
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        const cv::Mat& homography = rig.ViewHomography(i);
+        if (homography.empty())
+        {
+            continue;
+        }
+        const cv::Size& size = rig.ViewSize(i);
+        std::vector<cv::Point2f> corners = {
+            cv::Point2f(0, 0), cv::Point2f((float)size.width, 0),
+            cv::Point2f((float)size.width, (float)size.height),
+            cv::Point2f(0, (float)size.height)
+        };
+        std::vector<cv::Point2f> warped;
+        cv::perspectiveTransform(corners, warped, homography);
+        bounds[i] = cv::boundingRect(warped) & canvasRect;
+    }
+    TiffWriter writer;
+    if (!writer.Open(outputPath, canvas.width, canvas.height, m_tileSize))
+    {
+        return false;
+    }
+    LOG_INFO("Compositing %dx%d in %dx%d tiles", canvas.width,
+            canvas.height, writer.TilesAcross(), writer.TilesDown());
+    size_t window = 2 * m_pool.Size();
+    for (int ty = 0; ty < writer.TilesDown(); ++ty)
+    {
+        cv::Rect band(0, ty * m_tileSize, canvas.width,
+                std::min(m_tileSize, canvas.height - ty * m_tileSize));
+        std::vector<std::future<Strip>> decoded(files.size());
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            cv::Rect area = bounds[i] & band;
+            if (area.empty())
+            {
+                continue;
+            }
+            const std::string& file = files[i];
+            const cv::Mat& homography = rig.ViewHomography(i);
+            decoded[i] = m_pool.Submit([file, &homography, area]() {
+                return loadStrip(file, homography, area);
+            });
+        }
+        std::vector<Strip> strips(files.size());
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            if (decoded[i].valid())
+            {
+                strips[i] = decoded[i].get();
+            }
+        }
+        std::deque<std::future<cv::Mat>> tiles;
+        int written = 0;
+        for (int tx = 0; tx < writer.TilesAcross(); ++tx)
+        {
+            cv::Rect tile = cv::Rect(tx * m_tileSize, band.y, m_tileSize,
+                    band.height) & canvasRect;
+            tiles.push_back(m_pool.Submit([this, &strips, &bounds, tile]() {
+                cv::Mat res;
+                composeTile(strips, bounds, tile, res);
+                return res;
+            }));
+            while (tiles.size() >= window
+                    || (tx + 1 == writer.TilesAcross() && !tiles.empty()))
+            {
+                writer.WriteTile(written++, ty, tiles.front().get());
+                tiles.pop_front();
+            }
+        }
+    }
+    return writer.Close();
+}
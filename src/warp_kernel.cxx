@@ -0,0 +1,503 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include <opencv2/opencv.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WARP_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+#include "warp_kernel.hxx"
+#include "profiler.hxx"
+
+namespace {
+
+struct WarpParams
+{
+    const uchar* src;
+    size_t srcStep;
+    int srcCols;
+    int srcRows;
+    double inverse[9]; // destination -> source
+    float featherScale; // 1 / feather width, 0 - overwrite
+};
+
+typedef void (*RowFunc)(const WarpParams& p, uchar* dst, int y, int begin,
+        int end);
+
+/*
+ * Forced inline so the vector row functions can inline them despite their
+ * different target, a call out of AVX code costs more than the pixel.
+ */
+#ifdef __GNUC__
+#define WARP_INLINE inline __attribute__((always_inline))
+#else
+#define WARP_INLINE inline
+#endif
+
+WARP_INLINE uchar roundPixel(float value)
+{
+    return static_cast<uchar>(std::min(255.0f, std::max(0.0f,
+                    value + 0.5f)));
+}
+
+WARP_INLINE void blendPixel(uchar* d, float b, float g,
+        float r, float alpha)
+{
+    if (alpha >= 1.0f || 0 == (d[0] | d[1] | d[2]))
+    {
+        d[0] = roundPixel(b);
+        d[1] = roundPixel(g);
+        d[2] = roundPixel(r);
+        return;
+    }
+    d[0] = roundPixel(d[0] + alpha * (b - d[0]));
+    d[1] = roundPixel(d[1] + alpha * (g - d[1]));
+    d[2] = roundPixel(d[2] + alpha * (r - d[2]));
+}
+
+inline float featherAlpha(const WarpParams& p, float sx, float sy)
+{
+    if (0 == p.featherScale)
+    {
+        return 1.0f;
+    }
+    float border = std::min(std::min(sx, sy),
+            std::min(p.srcCols - 1 - sx, p.srcRows - 1 - sy));
+    return std::min(1.0f, border * p.featherScale);
+}
+
+void warpPixel(const WarpParams& p, uchar* d, int x, int y)
+{
+    const double* h = p.inverse;
+    double w = h[6] * x + h[7] * y + h[8];
+    if (w <= 0)
+    {
+        return;
+    }
+    float sx = static_cast<float>((h[0] * x + h[1] * y + h[2]) / w);
+    float sy = static_cast<float>((h[3] * x + h[4] * y + h[5]) / w);
+    if (!(sx >= 0 && sy >= 0 && sx <= p.srcCols - 1 && sy <= p.srcRows - 1))
+    {
+        return;
+    }
+    int x0 = static_cast<int>(sx);
+    int y0 = static_cast<int>(sy);
+    int x1 = std::min(x0 + 1, p.srcCols - 1);
+    int y1 = std::min(y0 + 1, p.srcRows - 1);
+    float fx = sx - x0;
+    float fy = sy - y0;
+    const uchar* r0 = p.src + y0 * p.srcStep;
+    const uchar* r1 = p.src + y1 * p.srcStep;
+    float c[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        float top = r0[x0 * 3 + k] + fx * (r0[x1 * 3 + k] - r0[x0 * 3 + k]);
+        float bottom = r1[x0 * 3 + k]
+            + fx * (r1[x1 * 3 + k] - r1[x0 * 3 + k]);
+        c[k] = top + fy * (bottom - top);
+    }
+    blendPixel(d, c[0], c[1], c[2], featherAlpha(p, sx, sy));
+}
+
+void warpRowScalar(const WarpParams& p, uchar* dst, int y, int begin, int end)
+{
+    for (int x = begin; x < end; ++x)
+    {
+        warpPixel(p, dst + x * 3, x, y);
+    }
+}
+
+#ifdef WARP_KERNEL_X86
+
+/*
+ * The vector paths sample only where the whole 2x2 neighbourhood plus one
+ * padding byte of the 32-bit loads lies inside the source (sx < cols - 2,
+ * sy < rows - 1). Lanes are either clearly inside or clearly outside by
+ * SAMPLE_EPSILON, otherwise the single precision coordinates could disagree
+ * with the scalar path on the source border and the group goes through
+ * warpPixel.
+ */
+
+const float SAMPLE_EPSILON = 1e-2f;
+
+inline int load32(const uchar* ptr)
+{
+    int value;
+    std::memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+/*
+ * Scalar loads rather than vpgatherdd: with the gather data sampling
+ * mitigation the gather instruction is several times slower than this.
+ */
+__attribute__((target("avx2")))
+inline __m256i load8(const uchar* base, const int* offsets, size_t shift)
+{
+    const uchar* s = base + shift;
+    return _mm256_setr_epi32(load32(s + offsets[0]), load32(s + offsets[1]),
+            load32(s + offsets[2]), load32(s + offsets[3]),
+            load32(s + offsets[4]), load32(s + offsets[5]),
+            load32(s + offsets[6]), load32(s + offsets[7]));
+}
+
+__attribute__((target("avx2,fma")))
+void warpRowAvx2(const WarpParams& p, uchar* dst, int y, int begin, int end)
+{
+    const double* h = p.inverse;
+    const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 h0 = _mm256_set1_ps((float)h[0]);
+    const __m256 h3 = _mm256_set1_ps((float)h[3]);
+    const __m256 h6 = _mm256_set1_ps((float)h[6]);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 eps = _mm256_set1_ps(SAMPLE_EPSILON);
+    const __m256 maxX = _mm256_set1_ps((float)(p.srcCols - 2));
+    const __m256 maxY = _mm256_set1_ps((float)(p.srcRows - 1));
+    const __m256 lastX = _mm256_set1_ps((float)(p.srcCols - 1));
+    const __m256 lastY = _mm256_set1_ps((float)(p.srcRows - 1));
+    const __m256 feather = _mm256_set1_ps(p.featherScale);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+    const __m256i step = _mm256_set1_epi32((int)p.srcStep);
+    const __m256i three = _mm256_set1_epi32(3);
+    alignas(32) int offsets[8];
+    alignas(32) float channels[3][8];
+    alignas(32) float alpha[8];
+    int x = begin;
+    for (; x + 8 <= end; x += 8)
+    {
+        __m256 xs = _mm256_add_ps(_mm256_set1_ps((float)x), lanes);
+        __m256 u = _mm256_fmadd_ps(h0, xs,
+                _mm256_set1_ps((float)(h[1] * y + h[2])));
+        __m256 v = _mm256_fmadd_ps(h3, xs,
+                _mm256_set1_ps((float)(h[4] * y + h[5])));
+        __m256 w = _mm256_fmadd_ps(h6, xs,
+                _mm256_set1_ps((float)(h[7] * y + h[8])));
+        __m256 sx = _mm256_div_ps(u, w);
+        __m256 sy = _mm256_div_ps(v, w);
+        __m256 front = _mm256_cmp_ps(w, zero, _CMP_GT_OQ);
+        __m256 interior = _mm256_and_ps(front, _mm256_and_ps(
+                    _mm256_and_ps(_mm256_cmp_ps(sx, eps, _CMP_GE_OQ),
+                        _mm256_cmp_ps(sy, eps, _CMP_GE_OQ)),
+                    _mm256_and_ps(_mm256_cmp_ps(sx, maxX, _CMP_LT_OQ),
+                        _mm256_cmp_ps(sy, maxY, _CMP_LT_OQ))));
+        __m256 outside = _mm256_or_ps(_mm256_cmp_ps(w, zero, _CMP_LE_OQ),
+                _mm256_or_ps(
+                    _mm256_or_ps(_mm256_cmp_ps(sx, _mm256_sub_ps(zero, eps),
+                            _CMP_LT_OQ),
+                        _mm256_cmp_ps(sy, _mm256_sub_ps(zero, eps),
+                            _CMP_LT_OQ)),
+                    _mm256_or_ps(_mm256_cmp_ps(sx, _mm256_add_ps(lastX, eps),
+                            _CMP_GT_OQ),
+                        _mm256_cmp_ps(sy, _mm256_add_ps(lastY, eps),
+                            _CMP_GT_OQ))));
+        int validMask = _mm256_movemask_ps(interior);
+        if (0xff != (validMask | _mm256_movemask_ps(outside)))
+        {
+            warpRowScalar(p, dst, y, x, x + 8);
+            continue;
+        }
+        if (0 == validMask)
+        {
+            continue;
+        }
+        __m256 valid = interior;
+        __m256 fxs = _mm256_floor_ps(sx);
+        __m256 fys = _mm256_floor_ps(sy);
+        __m256 fx = _mm256_sub_ps(sx, fxs);
+        __m256 fy = _mm256_sub_ps(sy, fys);
+        __m256i offset = _mm256_add_epi32(
+                _mm256_mullo_epi32(_mm256_cvttps_epi32(fys), step),
+                _mm256_mullo_epi32(_mm256_cvttps_epi32(fxs), three));
+        offset = _mm256_and_si256(offset, _mm256_castps_si256(valid));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(offsets), offset);
+        __m256i p00 = load8(p.src, offsets, 0);
+        __m256i p01 = load8(p.src, offsets, 3);
+        __m256i p10 = load8(p.src, offsets, p.srcStep);
+        __m256i p11 = load8(p.src, offsets, p.srcStep + 3);
+        for (int k = 0; k < 3; ++k)
+        {
+            __m256 c00 = _mm256_cvtepi32_ps(_mm256_and_si256(
+                        _mm256_srli_epi32(p00, 8 * k), byteMask));
+            __m256 c01 = _mm256_cvtepi32_ps(_mm256_and_si256(
+                        _mm256_srli_epi32(p01, 8 * k), byteMask));
+            __m256 c10 = _mm256_cvtepi32_ps(_mm256_and_si256(
+                        _mm256_srli_epi32(p10, 8 * k), byteMask));
+            __m256 c11 = _mm256_cvtepi32_ps(_mm256_and_si256(
+                        _mm256_srli_epi32(p11, 8 * k), byteMask));
+            __m256 top = _mm256_fmadd_ps(fx, _mm256_sub_ps(c01, c00), c00);
+            __m256 bottom = _mm256_fmadd_ps(fx, _mm256_sub_ps(c11, c10),
+                    c10);
+            _mm256_store_ps(channels[k], _mm256_fmadd_ps(fy,
+                        _mm256_sub_ps(bottom, top), top));
+        }
+        __m256 border = _mm256_min_ps(_mm256_min_ps(sx, sy), _mm256_min_ps(
+                    _mm256_sub_ps(lastX, sx), _mm256_sub_ps(lastY, sy)));
+        __m256 weight = _mm256_min_ps(one, _mm256_mul_ps(border, feather));
+        _mm256_store_ps(alpha, 0 == p.featherScale ? one : weight);
+        for (int i = 0; i < 8; ++i)
+        {
+            if (validMask & (1 << i))
+            {
+                blendPixel(dst + (x + i) * 3, channels[0][i],
+                        channels[1][i], channels[2][i], alpha[i]);
+            }
+        }
+    }
+    warpRowScalar(p, dst, y, x, end);
+}
+
+__attribute__((target("sse4.1")))
+void warpRowSse41(const WarpParams& p, uchar* dst, int y, int begin, int end)
+{
+    const double* h = p.inverse;
+    const __m128 lanes = _mm_setr_ps(0, 1, 2, 3);
+    const __m128 h0 = _mm_set1_ps((float)h[0]);
+    const __m128 h3 = _mm_set1_ps((float)h[3]);
+    const __m128 h6 = _mm_set1_ps((float)h[6]);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 eps = _mm_set1_ps(SAMPLE_EPSILON);
+    const __m128 maxX = _mm_set1_ps((float)(p.srcCols - 2));
+    const __m128 maxY = _mm_set1_ps((float)(p.srcRows - 1));
+    const __m128 lastX = _mm_set1_ps((float)(p.srcCols - 1));
+    const __m128 lastY = _mm_set1_ps((float)(p.srcRows - 1));
+    const __m128 feather = _mm_set1_ps(p.featherScale);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+    const __m128i step = _mm_set1_epi32((int)p.srcStep);
+    const __m128i three = _mm_set1_epi32(3);
+    alignas(16) int offsets[4];
+    alignas(16) float channels[3][4];
+    alignas(16) float alpha[4];
+    int x = begin;
+    for (; x + 4 <= end; x += 4)
+    {
+        __m128 xs = _mm_add_ps(_mm_set1_ps((float)x), lanes);
+        __m128 u = _mm_add_ps(_mm_mul_ps(h0, xs),
+                _mm_set1_ps((float)(h[1] * y + h[2])));
+        __m128 v = _mm_add_ps(_mm_mul_ps(h3, xs),
+                _mm_set1_ps((float)(h[4] * y + h[5])));
+        __m128 w = _mm_add_ps(_mm_mul_ps(h6, xs),
+                _mm_set1_ps((float)(h[7] * y + h[8])));
+        __m128 sx = _mm_div_ps(u, w);
+        __m128 sy = _mm_div_ps(v, w);
+        __m128 interior = _mm_and_ps(_mm_cmpgt_ps(w, zero), _mm_and_ps(
+                    _mm_and_ps(_mm_cmpge_ps(sx, eps), _mm_cmpge_ps(sy, eps)),
+                    _mm_and_ps(_mm_cmplt_ps(sx, maxX),
+                        _mm_cmplt_ps(sy, maxY))));
+        __m128 outside = _mm_or_ps(_mm_cmple_ps(w, zero), _mm_or_ps(
+                    _mm_or_ps(_mm_cmplt_ps(sx, _mm_sub_ps(zero, eps)),
+                        _mm_cmplt_ps(sy, _mm_sub_ps(zero, eps))),
+                    _mm_or_ps(_mm_cmpgt_ps(sx, _mm_add_ps(lastX, eps)),
+                        _mm_cmpgt_ps(sy, _mm_add_ps(lastY, eps)))));
+        int validMask = _mm_movemask_ps(interior);
+        if (0xf != (validMask | _mm_movemask_ps(outside)))
+        {
+            warpRowScalar(p, dst, y, x, x + 4);
+            continue;
+        }
+        if (0 == validMask)
+        {
+            continue;
+        }
+        __m128 valid = interior;
+        __m128 fxs = _mm_floor_ps(sx);
+        __m128 fys = _mm_floor_ps(sy);
+        __m128 fx = _mm_sub_ps(sx, fxs);
+        __m128 fy = _mm_sub_ps(sy, fys);
+        __m128i offset = _mm_add_epi32(
+                _mm_mullo_epi32(_mm_cvttps_epi32(fys), step),
+                _mm_mullo_epi32(_mm_cvttps_epi32(fxs), three));
+        offset = _mm_and_si128(offset, _mm_castps_si128(valid));
+        _mm_store_si128(reinterpret_cast<__m128i*>(offsets), offset);
+        const uchar* s = p.src;
+        size_t st = p.srcStep;
+        __m128i p00 = _mm_setr_epi32(load32(s + offsets[0]),
+                load32(s + offsets[1]), load32(s + offsets[2]),
+                load32(s + offsets[3]));
+        __m128i p01 = _mm_setr_epi32(load32(s + offsets[0] + 3),
+                load32(s + offsets[1] + 3), load32(s + offsets[2] + 3),
+                load32(s + offsets[3] + 3));
+        __m128i p10 = _mm_setr_epi32(load32(s + offsets[0] + st),
+                load32(s + offsets[1] + st), load32(s + offsets[2] + st),
+                load32(s + offsets[3] + st));
+        __m128i p11 = _mm_setr_epi32(load32(s + offsets[0] + st + 3),
+                load32(s + offsets[1] + st + 3),
+                load32(s + offsets[2] + st + 3),
+                load32(s + offsets[3] + st + 3));
+        for (int k = 0; k < 3; ++k)
+        {
+            __m128 c00 = _mm_cvtepi32_ps(_mm_and_si128(
+                        _mm_srli_epi32(p00, 8 * k), byteMask));
+            __m128 c01 = _mm_cvtepi32_ps(_mm_and_si128(
+                        _mm_srli_epi32(p01, 8 * k), byteMask));
+            __m128 c10 = _mm_cvtepi32_ps(_mm_and_si128(
+                        _mm_srli_epi32(p10, 8 * k), byteMask));
+            __m128 c11 = _mm_cvtepi32_ps(_mm_and_si128(
+                        _mm_srli_epi32(p11, 8 * k), byteMask));
+            __m128 top = _mm_add_ps(c00,
+                    _mm_mul_ps(fx, _mm_sub_ps(c01, c00)));
+            __m128 bottom = _mm_add_ps(c10,
+                    _mm_mul_ps(fx, _mm_sub_ps(c11, c10)));
+            _mm_store_ps(channels[k], _mm_add_ps(top,
+                        _mm_mul_ps(fy, _mm_sub_ps(bottom, top))));
+        }
+        __m128 border = _mm_min_ps(_mm_min_ps(sx, sy), _mm_min_ps(
+                    _mm_sub_ps(lastX, sx), _mm_sub_ps(lastY, sy)));
+        __m128 weight = _mm_min_ps(one, _mm_mul_ps(border, feather));
+        _mm_store_ps(alpha, 0 == p.featherScale ? one : weight);
+        for (int i = 0; i < 4; ++i)
+        {
+            if (validMask & (1 << i))
+            {
+                blendPixel(dst + (x + i) * 3, channels[0][i],
+                        channels[1][i], channels[2][i], alpha[i]);
+            }
+        }
+    }
+    warpRowScalar(p, dst, y, x, end);
+}
+
+#endif // WARP_KERNEL_X86
+
+struct RowKernel
+{
+    RowFunc func;
+    const char* name;
+};
+
+RowKernel selectRowKernel()
+{
+#ifdef WARP_KERNEL_X86
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        return { warpRowAvx2, "avx2" };
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return { warpRowSse41, "sse4.1" };
+    }
+#endif
+    return { warpRowScalar, "scalar" };
+}
+
+const RowKernel& bestRowKernel()
+{
+    static const RowKernel kernel = selectRowKernel();
+    return kernel;
+}
+
+/*
+ * Horizontal extent of the convex quadrilateral on row y, widened by a
+ * pixel for rounding. The quadrilateral is the warped source rectangle,
+ * which contains every sample position.
+ */
+bool rowSpan(const std::vector<cv::Point2f>& quad, int y, int& begin,
+        int& end)
+{
+    float yc = static_cast<float>(y);
+    float left = std::numeric_limits<float>::max();
+    float right = std::numeric_limits<float>::lowest();
+    for (size_t i = 0; i < quad.size(); ++i)
+    {
+        const cv::Point2f& a = quad[i];
+        const cv::Point2f& b = quad[(i + 1) % quad.size()];
+        if ((a.y <= yc && b.y > yc) || (b.y <= yc && a.y > yc))
+        {
+            float xi = a.x + (yc - a.y) / (b.y - a.y) * (b.x - a.x);
+            left = std::min(left, xi);
+            right = std::max(right, xi);
+        }
+    }
+    if (left > right)
+    {
+        return false;
+    }
+    begin = std::max(begin, cvFloor(left) - 1);
+    end = std::min(end, cvCeil(right) + 2);
+    return begin < end;
+}
+
+} // namespace
+
+WarpKernel::WarpKernel(int featherWidth)
+    : m_featherWidth(featherWidth)
+    , m_bSimd(true)
+{
+}
+
+void WarpKernel::SetFeatherWidth(int featherWidth)
+{
+    m_featherWidth = featherWidth;
+}
+
+void WarpKernel::SetSimd(bool enabled)
+{
+    m_bSimd = enabled;
+}
+
+const char* WarpKernel::InstructionSet() const
+{
+    return m_bSimd ? bestRowKernel().name : "scalar";
+}
+
+void WarpKernel::Warp(const cv::Mat& src, cv::Mat& dst,
+        const cv::Mat& homography) const
+{
+    CV_Assert(CV_8UC3 == src.type() && CV_8UC3 == dst.type());
+    PROFILE_SCOPE("warp_kernel");
+    cv::Mat forward;
+    homography.convertTo(forward, CV_64F);
+    std::vector<cv::Point2f> corners = {
+        cv::Point2f(0, 0), cv::Point2f((float)src.cols, 0),
+        cv::Point2f((float)src.cols, (float)src.rows),
+        cv::Point2f(0, (float)src.rows)
+    };
+    // With every corner in front of the camera the warped quad is convex
+    const double* w = forward.ptr<double>(2);
+    bool convex = true;
+    for (const auto& c : corners)
+    {
+        convex = convex && (w[0] * c.x + w[1] * c.y + w[2] > 0);
+    }
+    std::vector<cv::Point2f> quad;
+    cv::perspectiveTransform(corners, quad, forward);
+    cv::Rect area(0, 0, dst.cols, dst.rows);
+    if (convex)
+    {
+        area &= cv::boundingRect(quad);
+    }
+    if (area.empty())
+    {
+        return;
+    }
+    WarpParams params;
+    params.src = src.ptr();
+    params.srcStep = src.step;
+    params.srcCols = src.cols;
+    params.srcRows = src.rows;
+    params.featherScale = (m_featherWidth > 0) ? 1.0f / m_featherWidth : 0;
+    cv::Mat inverse = forward.inv();
+    std::memcpy(params.inverse, inverse.ptr<double>(0), sizeof(params.inverse));
+    // 32-bit sample offsets must address the whole source
+    bool simd = m_bSimd && src.step * src.rows < (size_t)INT_MAX;
+    RowFunc rowFunc = simd ? bestRowKernel().func : warpRowScalar;
+    cv::parallel_for_(cv::Range(area.y, area.y + area.height),
+            [&](const cv::Range& rows) {
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            int begin = area.x;
+            int end = area.x + area.width;
+            if (convex && !rowSpan(quad, y, begin, end))
+            {
+                continue;
+            }
+            rowFunc(params, dst.ptr(y), y, begin, end);
+        }
+    });
+}
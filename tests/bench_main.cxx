@@ -0,0 +1,527 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <boost/program_options.hpp>
+
+#include "image_processing.hxx"
+#include "image_stitching.hxx"
+#include "profiler.hxx"
+#include "logging.hxx"
+#include "warp_kernel.hxx"
+
+#include "psnr.hxx"
+#include "ssim.hxx"
+#include "synthetic.hxx"
+
+namespace po = boost::program_options;
+
+// Feather width of the SIMD vs scalar check on a covered destination
+static const int WARP_CHECK_FEATHER = 16;
+
+struct BenchConfig
+{
+    int frameWidth;
+    int frameHeight;
+    int count;
+    double overlap;
+    double jitter;
+    int seed;
+    int repeat;
+    int keypoints;
+    int grid;
+    float ratio;
+    float ransac;
+    std::string detector;
+    std::string matcher;
+    std::string estimator;
+    double confidence;
+    int maxIters;
+    bool localOptim = false;
+    std::string source;
+    std::string output;
+    std::string label;
+};
+
+struct StageStats
+{
+    std::vector<double> ms;
+    double megapixels = 0;
+};
+
+struct PairAccuracy
+{
+    bool registered = false;
+    double cornerError = 0;
+    double psnr = 0;
+    double ssim = 0;
+    int inliers = 0;
+    int iterationsBound = 0;
+};
+
+struct WarpCheck
+{
+    std::string instructionSet;
+    double psnr = 0; // worst pair, kernel vs cv::warpPerspective
+    double maxDiff = 0; // SIMD vs scalar kernel, largest channel difference
+    double maxDiffFeathered = 0; // the same onto a covered destination
+};
+
+typedef std::map<std::string, StageStats> Stages;
+
+class Stopwatch
+{
+public:
+    Stopwatch() : m_start(std::chrono::steady_clock::now()) {}
+
+    double ElapsedMs() const
+    {
+        return std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+double percentile(std::vector<double> values, double p)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * values.size()));
+    return values[std::min(values.size(), std::max<size_t>(1, rank)) - 1];
+}
+
+double cornerError(const cv::Mat& estimated, const cv::Mat& truth,
+        const cv::Size& size)
+{
+    Point2fVec corners = {
+        cv::Point2f(0, 0),
+        cv::Point2f(size.width, 0),
+        cv::Point2f(size.width, size.height),
+        cv::Point2f(0, size.height)
+    };
+    Point2fVec est;
+    Point2fVec gt;
+    cv::perspectiveTransform(corners, est, estimated);
+    cv::perspectiveTransform(corners, gt, truth);
+    double error = 0;
+    for (size_t i = 0; i < corners.size(); ++i)
+    {
+        error += cv::norm(est[i] - gt[i]);
+    }
+    return error / corners.size();
+}
+
+/*
+ * Registration quality as seen in the mosaic: frame2 warped into frame1
+ * with the estimated homography, compared with frame1 over the overlap.
+ */
+void overlapQuality(const cv::Mat& img1, const cv::Mat& img2,
+        const cv::Mat& homography, PairAccuracy& accuracy)
+{
+    cv::Mat warped;
+    cv::Mat mask;
+    cv::warpPerspective(img2, warped, homography, img1.size());
+    cv::warpPerspective(cv::Mat(img2.size(), CV_8U, cv::Scalar(255)), mask,
+            homography, img1.size(), cv::INTER_NEAREST);
+    cv::erode(mask, mask, cv::Mat(), cv::Point(-1, -1), 2);
+    if (0 == cv::countNonZero(mask))
+    {
+        return;
+    }
+    accuracy.psnr = computePSNR(img1, warped, mask);
+    cv::Scalar ssim = computeMSSIM(img1, warped, mask);
+    accuracy.ssim = (ssim[0] + ssim[1] + ssim[2]) / 3.0;
+}
+
+void benchPairs(const BenchConfig& config, const SyntheticDataset& dataset,
+        const ImageProcessing& proc, Stages& stages,
+        std::vector<PairAccuracy>& accuracy)
+{
+    std::vector<ImageFeatures> features(dataset.frames.size());
+    for (size_t i = 0; i < dataset.frames.size(); ++i)
+    {
+        const cv::Mat& frame = dataset.frames[i];
+        double mp = frame.total() / 1e6;
+        cv::Mat gray;
+        Stopwatch grayWatch;
+        proc.MakeGray(frame, gray);
+        stages["gray"].ms.push_back(grayWatch.ElapsedMs());
+        stages["gray"].megapixels += mp;
+        Stopwatch detectWatch;
+        proc.DetectFeatures(gray, features[i], config.keypoints);
+        stages["detect"].ms.push_back(detectWatch.ElapsedMs());
+        stages["detect"].megapixels += mp;
+    }
+    for (size_t i = 0; i + 1 < dataset.frames.size(); ++i)
+    {
+        const cv::Mat& img1 = dataset.frames[i];
+        const cv::Mat& img2 = dataset.frames[i + 1];
+        PairAccuracy pair;
+        DMatchVec matches;
+        Stopwatch matchWatch;
+        proc.MatchFeatures(features[i], features[i + 1], matches,
+                config.ratio);
+        stages["match"].ms.push_back(matchWatch.ElapsedMs());
+        cv::Mat homography;
+        EstimationStats estimation;
+        Stopwatch homographyWatch;
+        proc.TransformHomography(features[i].keypoints,
+                features[i + 1].keypoints, matches, homography,
+                config.ransac, &estimation);
+        pair.inliers = estimation.inliers;
+        pair.iterationsBound = estimation.iterationsBound;
+        stages["homography"].ms.push_back(homographyWatch.ElapsedMs());
+        if (!homography.empty())
+        {
+            homography.convertTo(homography, CV_64F);
+            Point2fVec allCorners;
+            cv::Mat result;
+            Stopwatch warpWatch;
+            proc.TransformCorners(img1, img2, homography, allCorners);
+            proc.WarpImages(img1, img2, homography, allCorners, result);
+            stages["warp"].ms.push_back(warpWatch.ElapsedMs());
+            stages["warp"].megapixels += result.total() / 1e6;
+            cv::Mat truth = dataset.homographies[i]
+                * dataset.homographies[i + 1].inv();
+            pair.registered = true;
+            pair.cornerError = cornerError(homography, truth, img2.size());
+            overlapQuality(img1, img2, homography, pair);
+        }
+        accuracy.push_back(pair);
+    }
+}
+
+/*
+ * Warp kernel against cv::warpPerspective on the ground truth pairs, each
+ * frame warped onto an empty canvas twice its width.
+ */
+void benchWarp(const SyntheticDataset& dataset, Stages& stages,
+        WarpCheck& check)
+{
+    WarpKernel simd;
+    WarpKernel scalar;
+    scalar.SetSimd(false);
+    WarpKernel simdFeathered(WARP_CHECK_FEATHER);
+    WarpKernel scalarFeathered(WARP_CHECK_FEATHER);
+    scalarFeathered.SetSimd(false);
+    check.instructionSet = simd.InstructionSet();
+    check.psnr = 0;
+    check.maxDiff = 0;
+    check.maxDiffFeathered = 0;
+    for (size_t i = 0; i + 1 < dataset.frames.size(); ++i)
+    {
+        const cv::Mat& img = dataset.frames[i + 1];
+        cv::Mat shift = (cv::Mat_<double>(3, 3) <<
+                1, 0, 0,
+                0, 1, img.rows / 10,
+                0, 0, 1);
+        cv::Mat homography = shift * dataset.homographies[i]
+            * dataset.homographies[i + 1].inv();
+        cv::Size size(img.cols * 2, img.rows + img.rows / 5);
+        double mp = size.area() / 1e6;
+        cv::Mat reference(size, CV_8UC3, cv::Scalar::all(0));
+        Stopwatch opencvWatch;
+        cv::warpPerspective(img, reference, homography, size,
+                cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+        stages["warp_opencv"].ms.push_back(opencvWatch.ElapsedMs());
+        stages["warp_opencv"].megapixels += mp;
+        cv::Mat warped(size, CV_8UC3, cv::Scalar::all(0));
+        Stopwatch simdWatch;
+        simd.Warp(img, warped, homography);
+        stages["warp_kernel"].ms.push_back(simdWatch.ElapsedMs());
+        stages["warp_kernel"].megapixels += mp;
+        cv::Mat warpedScalar(size, CV_8UC3, cv::Scalar::all(0));
+        Stopwatch scalarWatch;
+        scalar.Warp(img, warpedScalar, homography);
+        stages["warp_kernel_scalar"].ms.push_back(scalarWatch.ElapsedMs());
+        stages["warp_kernel_scalar"].megapixels += mp;
+        check.maxDiff = std::max(check.maxDiff,
+                cv::norm(warped, warpedScalar, cv::NORM_INF));
+        // Feathering only blends where the destination is already covered
+        cv::Mat covered(size, CV_8UC3, cv::Scalar::all(0));
+        dataset.frames[i].copyTo(covered(cv::Rect(0, 0, img.cols, img.rows)));
+        cv::Mat feathered = covered.clone();
+        simdFeathered.Warp(img, feathered, homography);
+        cv::Mat featheredScalar = covered.clone();
+        scalarFeathered.Warp(img, featheredScalar, homography);
+        check.maxDiffFeathered = std::max(check.maxDiffFeathered,
+                cv::norm(feathered, featheredScalar, cv::NORM_INF));
+        // Compare away from the edges, border handling differs by design
+        cv::Mat mask;
+        cv::warpPerspective(cv::Mat(img.size(), CV_8U, cv::Scalar(255)),
+                mask, homography, size, cv::INTER_NEAREST);
+        cv::erode(mask, mask, cv::Mat(), cv::Point(-1, -1), 2);
+        double psnr = computePSNR(reference, warped, mask);
+        check.psnr = (0 == i) ? psnr : std::min(check.psnr, psnr);
+    }
+}
+
+void benchChain(const SyntheticDataset& dataset, Stitcher& stitcher,
+        Stages& stages)
+{
+    cv::Mat result;
+    Stopwatch total;
+    for (const auto& frame : dataset.frames)
+    {
+        cv::Mat image = frame;
+        Stopwatch frameWatch;
+        stitcher.StitchNext(&image, &result);
+        stages["chain_frame"].ms.push_back(frameWatch.ElapsedMs());
+        stages["chain_frame"].megapixels += frame.total() / 1e6;
+    }
+    stages["chain_total"].ms.push_back(total.ElapsedMs());
+}
+
+void writeJson(std::ostream& os, const BenchConfig& config,
+        const Stages& stages, const std::vector<PairAccuracy>& accuracy,
+        const WarpCheck& warp)
+{
+    os << "{\n  \"label\": \"" << config.label << "\",\n"
+        << "  \"config\": {\"frame_width\": " << config.frameWidth
+        << ", \"frame_height\": " << config.frameHeight
+        << ", \"count\": " << config.count
+        << ", \"overlap\": " << config.overlap
+        << ", \"jitter\": " << config.jitter
+        << ", \"seed\": " << config.seed
+        << ", \"repeat\": " << config.repeat
+        << ", \"keypoints\": " << config.keypoints
+        << ", \"grid\": " << config.grid
+        << ", \"detector\": \"" << config.detector << "\""
+        << ", \"matcher\": \"" << config.matcher << "\""
+        << ", \"estimator\": \"" << config.estimator << "\""
+        << ", \"confidence\": " << config.confidence
+        << ", \"max_iters\": " << config.maxIters
+        << ", \"local_optim\": " << (config.localOptim ? "true" : "false")
+        << "},\n"
+        << "  \"stages\": {";
+    bool first = true;
+    for (const auto& stage : stages)
+    {
+        const StageStats& stats = stage.second;
+        double totalMs = 0;
+        for (double ms : stats.ms)
+        {
+            totalMs += ms;
+        }
+        double seconds = std::max(totalMs / 1e3, 1e-9);
+        os << (first ? "" : ",") << "\n    \"" << stage.first << "\": {"
+            << "\"calls\": " << stats.ms.size()
+            << ", \"total_ms\": " << totalMs
+            << ", \"p50_ms\": " << percentile(stats.ms, 50)
+            << ", \"p90_ms\": " << percentile(stats.ms, 90)
+            << ", \"p99_ms\": " << percentile(stats.ms, 99)
+            << ", \"max_ms\": " << percentile(stats.ms, 100)
+            << ", \"per_second\": " << stats.ms.size() / seconds;
+        if (stats.megapixels > 0)
+        {
+            os << ", \"mp_per_second\": " << stats.megapixels / seconds;
+        }
+        os << "}";
+        first = false;
+    }
+    size_t registered = 0;
+    std::vector<double> errors;
+    double psnr = 0;
+    double ssim = 0;
+    double inliers = 0;
+    double iterationsBound = 0;
+    for (const auto& pair : accuracy)
+    {
+        if (!pair.registered)
+        {
+            continue;
+        }
+        ++registered;
+        errors.push_back(pair.cornerError);
+        psnr += pair.psnr;
+        ssim += pair.ssim;
+        inliers += pair.inliers;
+        iterationsBound += pair.iterationsBound;
+    }
+    double denom = std::max<size_t>(1, registered);
+    os << "\n  },\n  \"accuracy\": {\"pairs\": " << accuracy.size()
+        << ", \"registered\": " << registered
+        << ", \"corner_error_p50_px\": " << percentile(errors, 50)
+        << ", \"corner_error_max_px\": " << percentile(errors, 100)
+        << ", \"psnr_db\": " << psnr / denom
+        << ", \"ssim\": " << ssim / denom
+        << ", \"inliers\": " << inliers / denom
+        << ", \"iterations_bound\": " << iterationsBound / denom << "},\n"
+        << "  \"warp_kernel\": {\"instruction_set\": \""
+        << warp.instructionSet << "\", \"psnr_vs_opencv_db\": " << warp.psnr
+        << ", \"max_diff_vs_scalar\": " << warp.maxDiff
+        << ", \"max_diff_vs_scalar_feathered\": " << warp.maxDiffFeathered
+        << "},\n"
+        << "  \"memory\": {\"peak_rss_kb\": " << Profiler::PeakRssKb()
+        << ", \"allocations\": " << Profiler::TotalAllocations()
+        << ", \"allocated_bytes\": " << Profiler::TotalAllocatedBytes()
+        << "}\n}\n";
+}
+
+bool parseArgs(int argc, char** argv, BenchConfig& config)
+{
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "Produce help message")
+        ("width", po::value<int>(&config.frameWidth)->default_value(1280),
+         "Frame width")
+        ("height", po::value<int>(&config.frameHeight)->default_value(720),
+         "Frame height")
+        ("count,n", po::value<int>(&config.count)->default_value(8),
+         "Frames in the synthetic panorama")
+        ("overlap", po::value<double>(&config.overlap)->default_value(0.4),
+         "Overlap fraction between neighbouring frames")
+        ("jitter", po::value<double>(&config.jitter)->default_value(12),
+         "Perspective jitter of the crop corners in pixels")
+        ("seed", po::value<int>(&config.seed)->default_value(1),
+         "Random seed of the generated dataset")
+        ("repeat", po::value<int>(&config.repeat)->default_value(3),
+         "Benchmark passes over the dataset")
+        ("keypoints,k", po::value<int>(&config.keypoints)
+         ->default_value(10000), "Keypoints count")
+        ("grid", po::value<int>(&config.grid)->default_value(0),
+         "Detect on an n x n grid with a per-cell keypoint budget")
+        ("ratio", po::value<float>(&config.ratio)->default_value(0.75),
+         "Distance filter ratio")
+        ("RANSAC,R", po::value<float>(&config.ransac)->default_value(1.5),
+         "RANSAC value")
+        ("detector", po::value<std::string>(&config.detector)
+         ->default_value("sift"), "Feature detector (sift, orb, akaze)")
+        ("matcher", po::value<std::string>(&config.matcher)
+         ->default_value("bf"), "Descriptor matcher (bf, kdtree, lsh)")
+        ("estimator", po::value<std::string>(&config.estimator)
+         ->default_value("ransac"),
+         "Robust homography estimator (ransac, prosac, usac, magsac)")
+        ("confidence", po::value<double>(&config.confidence)
+         ->default_value(0.995), "Estimator confidence")
+        ("max-iters", po::value<int>(&config.maxIters)->default_value(2000),
+         "Estimator iteration limit")
+        ("local-optim", "Local optimisation of the best model")
+        ("source", po::value<std::string>(&config.source)->default_value(""),
+         "Cut frames from this image instead of a generated one")
+        ("output,o", po::value<std::string>(&config.output)
+         ->default_value(""), "JSON report path (stdout if empty)")
+        ("label", po::value<std::string>(&config.label)->default_value(""),
+         "Free-form label stored in the report (version, host)");
+    try
+    {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help"))
+        {
+            std::cout << desc << std::endl;
+            return false;
+        }
+        config.localOptim = vm.count("local-optim") > 0;
+        po::notify(vm);
+    }
+    catch ( const po::error& e )
+    {
+        std::cerr << "Failed to parse arguments: " << e.what() << std::endl;
+        std::cout << desc << std::endl;
+        return false;
+    }
+    config.count = std::max(2, config.count);
+    config.repeat = std::max(1, config.repeat);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    BenchConfig config;
+    if ( !parseArgs(argc, argv, config) )
+    {
+        return -1;
+    }
+    Logging::DisableLogging();
+    Profiler::EnableAllocationCounts();
+    DetectorType detector = DetectorType::SIFT;
+    MatcherType matcher = MatcherType::BRUTE_FORCE;
+    if ( "orb" == config.detector )
+    {
+        detector = DetectorType::ORB;
+    }
+    else if ( "akaze" == config.detector )
+    {
+        detector = DetectorType::AKAZE;
+    }
+    if ( "kdtree" == config.matcher )
+    {
+        matcher = MatcherType::KDTREE;
+    }
+    else if ( "lsh" == config.matcher )
+    {
+        matcher = MatcherType::LSH;
+    }
+    EstimatorParams estimator;
+    estimator.confidence = config.confidence;
+    estimator.maxIters = config.maxIters;
+    estimator.localOptimization = config.localOptim;
+    if ( "prosac" == config.estimator )
+    {
+        estimator.type = EstimatorType::PROSAC;
+    }
+    else if ( "usac" == config.estimator )
+    {
+        estimator.type = EstimatorType::USAC;
+    }
+    else if ( "magsac" == config.estimator )
+    {
+        estimator.type = EstimatorType::MAGSAC;
+    }
+    cv::Mat bundled;
+    if ( !config.source.empty() )
+    {
+        bundled = cv::imread(config.source);
+        if ( bundled.empty() )
+        {
+            std::cerr << "Unable to read source image: " << config.source
+                << std::endl;
+            return -2;
+        }
+    }
+    SyntheticDataset dataset;
+    makeSyntheticDataset(bundled, cv::Size(config.frameWidth,
+                config.frameHeight), config.count, config.overlap,
+            config.jitter, config.seed, dataset);
+    ImageProcessing proc(detector, matcher, 0, estimator, config.grid);
+    Stages stages;
+    std::vector<PairAccuracy> accuracy;
+    WarpCheck warp;
+    for (int pass = 0; pass < config.repeat; ++pass)
+    {
+        std::vector<PairAccuracy> passAccuracy;
+        benchPairs(config, dataset, proc, stages, passAccuracy);
+        benchWarp(dataset, stages, warp);
+        Stitcher stitcher(config.ratio, config.keypoints, config.ransac);
+        stitcher.SetDetectorType(detector);
+        stitcher.SetMatcherType(matcher);
+        stitcher.SetEstimator(estimator);
+        stitcher.SetGrid(config.grid);
+        benchChain(dataset, stitcher, stages);
+        accuracy = std::move(passAccuracy);
+    }
+    if ( config.output.empty() )
+    {
+        writeJson(std::cout, config, stages, accuracy, warp);
+        return 0;
+    }
+    std::ofstream os(config.output);
+    if ( !os.is_open() )
+    {
+        std::cerr << "Unable to write report: " << config.output << std::endl;
+        return -3;
+    }
+    writeJson(os, config, stages, accuracy, warp);
+    return 0;
+}
@@ -19,16 +19,20 @@ double computePSNR(const cv::Mat& I1, const cv::Mat& I2, const cv::Mat& mask)
     s1.convertTo(s1, CV_32F);
     s1 = s1.mul(s1);
 
-    if (mask.empty())
-        mask = cv::Mat::ones(I1.size(), CV_8U);
-
-    double sse = cv::sum(s1.mul(mask))[0] + cv::sum(s1.mul(mask))[1] + cv::sum(s1.mul(mask))[2];
-    int totalPixels = cv::countNonZero(mask) * I1.channels();
-
-    if (sse <= 1e-10 || totalPixels == 0)
+    cv::Mat roi = mask;
+    if (roi.empty())
+        roi = cv::Mat(I1.size(), CV_8U, cv::Scalar(255));
+
+    cv::Scalar channelsMse = cv::mean(s1, roi);
+    int totalPixels = cv::countNonZero(roi);
+    double mse = 0;
+    for (int i = 0; i < I1.channels(); ++i)
+        mse += channelsMse[i];
+    mse /= I1.channels();
+
+    if (mse <= 1e-10 || totalPixels == 0)
         return 100;
 
-    double mse = sse / totalPixels;
     double psnr = 10.0 * log10((255 * 255) / mse);
     return psnr;
 }
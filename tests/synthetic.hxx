@@ -0,0 +1,111 @@
+#ifndef TEST_SYNTHETIC_HXX
+#define TEST_SYNTHETIC_HXX
+
+/*
+ * Synthetic panorama dataset: overlapping frames cut from one source image
+ * with a known homography per frame. Frame i sees the source through
+ * homographies[i] (source -> frame), so the ground truth pair homography
+ * in the stitcher convention (frame i + 1 -> frame i) is
+ * homographies[i] * homographies[i + 1].inv().
+ */
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+struct SyntheticDataset
+{
+    cv::Mat source;
+    std::vector<cv::Mat> frames;
+    std::vector<cv::Mat> homographies;
+};
+
+cv::Mat makeSyntheticSource(const cv::Size& size, cv::RNG& rng)
+{
+    cv::Mat noise(size.height / 8 + 1, size.width / 8 + 1, CV_8UC3);
+    rng.fill(noise, cv::RNG::UNIFORM, cv::Scalar::all(0),
+            cv::Scalar::all(255));
+    cv::Mat source;
+    cv::resize(noise, source, size, 0, 0, cv::INTER_CUBIC);
+    int shapes = size.area() / 2000;
+    for (int i = 0; i < shapes; ++i)
+    {
+        cv::Point center(rng.uniform(0, size.width),
+                rng.uniform(0, size.height));
+        cv::Scalar color(rng.uniform(0, 256), rng.uniform(0, 256),
+                rng.uniform(0, 256));
+        int radius = rng.uniform(3, 40);
+        switch (rng.uniform(0, 3))
+        {
+        case 0:
+            cv::circle(source, center, radius, color, cv::FILLED);
+            break;
+        case 1:
+            cv::rectangle(source, cv::Rect(center.x, center.y, radius,
+                        rng.uniform(3, 40)), color, cv::FILLED);
+            break;
+        default:
+            cv::line(source, center, cv::Point(center.x + radius,
+                        center.y + rng.uniform(-40, 40)), color, 2);
+            break;
+        }
+    }
+    cv::GaussianBlur(source, source, cv::Size(3, 3), 0);
+    return source;
+}
+
+cv::Mat frameHomography(const cv::Rect& crop, double jitter, cv::RNG& rng)
+{
+    cv::Point2f dst[4] = {
+        cv::Point2f(0, 0),
+        cv::Point2f(crop.width, 0),
+        cv::Point2f(crop.width, crop.height),
+        cv::Point2f(0, crop.height)
+    };
+    cv::Point2f src[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        src[i] = dst[i] + cv::Point2f(crop.x, crop.y) + cv::Point2f(
+                rng.uniform(-jitter, jitter), rng.uniform(-jitter, jitter));
+    }
+    return cv::getPerspectiveTransform(src, dst);
+}
+
+/*
+ * Cuts `count` frames of `frameSize` left to right with the given overlap
+ * fraction. Each crop corner is jittered by up to `jitter` pixels, which
+ * gives every frame a small perspective distortion.
+ */
+void makeSyntheticDataset(const cv::Mat& bundled, const cv::Size& frameSize,
+        int count, double overlap, double jitter, int seed,
+        SyntheticDataset& dataset)
+{
+    cv::RNG rng(seed);
+    int step = std::max(1, cvRound(frameSize.width * (1.0 - overlap)));
+    int margin = cvCeil(jitter) + 1;
+    cv::Size sourceSize(step * (count - 1) + frameSize.width + 2 * margin,
+            frameSize.height + 2 * margin);
+    if (bundled.empty())
+    {
+        dataset.source = makeSyntheticSource(sourceSize, rng);
+    }
+    else
+    {
+        cv::resize(bundled, dataset.source, sourceSize, 0, 0,
+                cv::INTER_AREA);
+    }
+    dataset.frames.clear();
+    dataset.homographies.clear();
+    for (int i = 0; i < count; ++i)
+    {
+        cv::Rect crop(margin + i * step, margin, frameSize.width,
+                frameSize.height);
+        cv::Mat homography = frameHomography(crop, jitter, rng);
+        cv::Mat frame;
+        cv::warpPerspective(dataset.source, frame, homography, frameSize,
+                cv::INTER_LINEAR, cv::BORDER_REFLECT);
+        dataset.frames.push_back(frame);
+        dataset.homographies.push_back(homography);
+    }
+}
+
+#endif // TEST_SYNTHETIC_HXX